@@ -0,0 +1,246 @@
+#ifndef BIND_H
+#define BIND_H
+
+#include <optional>
+#include <string_view>
+#include <tuple>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+#include "evaluator.h"
+
+/*
+  Typed bindings for builtins.
+
+  bind("name", f) turns a function or captureless lambda into a LispFunction that
+  takes its args as a span. f's parameter types say how each arg gets converted:
+    int               a LispInt's value
+    bool              false for nil and false, true for anything else
+    std::string_view  a String's contents, without copying. Only good during the call.
+    std::string       a String's contents, copied
+    lref              the arg as is. Take it as const lref& to skip the refcount.
+    std::optional<T>  any of the above, but it can be left off. Only at the end.
+    ArgSpan           all the args that are left. Only as the last parameter.
+  f can return lref, int, bool, std::string, std::string_view or void (nil).
+
+  bind_with_callstack is the same for builtins that need the callstack, like the
+  ones that eval. f takes it as its first param, before the args.
+
+  The arity comes from the parameter types, so it's worked out at compile time and
+  checked with two compares. Each conversion is a type check and a field read;
+  nothing gets consed or put in a tuple.
+*/
+
+namespace bind_detail {
+
+// Only exact types, which is fine since nothing derives from LispInt or String.
+// Comparing typeids is a lot cheaper than a dynamic_cast.
+template<typename T>
+const T* exactly(const lref& arg) {
+  auto obj = arg.get();
+  return obj != nullptr && typeid(*obj) == typeid(T) ? static_cast<const T*>(obj) : nullptr;
+}
+
+[[noreturn]] inline void bad_arg(const char* name, size_t i, const char* expected,
+                                 const lref& arg) {
+  throw eval_error(std::string("Argument ") + std::to_string(i + 1) + " to " + name
+                   + " should be " + expected + ": " + try_repr(arg));
+}
+
+template<typename T>
+struct Arg;
+
+// convert is for one arg on its own, get for the i'th of args
+template<>
+struct Arg<int> {
+  static int convert(const char* name, size_t i, const lref& arg) {
+    auto as_int = exactly<LispInt>(arg);
+    if (as_int == nullptr) {
+      bad_arg(name, i, "an int", arg);
+    }
+    return as_int->val;
+  }
+  static int get(const char* name, ArgSpan args, size_t i) { return convert(name, i, args[i]); }
+};
+
+template<>
+struct Arg<bool> {
+  static bool get(const char*, ArgSpan args, size_t i) {
+    return args[i] != Nil && args[i] != False;
+  }
+};
+
+template<>
+struct Arg<std::string_view> {
+  static std::string_view convert(const char* name, size_t i, const lref& arg) {
+    auto str = exactly<String>(arg);
+    if (str == nullptr) {
+      bad_arg(name, i, "a string", arg);
+    }
+    return str->value;
+  }
+  static std::string_view get(const char* name, ArgSpan args, size_t i) {
+    return convert(name, i, args[i]);
+  }
+};
+
+template<>
+struct Arg<std::string> {
+  static std::string convert(const char* name, size_t i, const lref& arg) {
+    return std::string(Arg<std::string_view>::convert(name, i, arg));
+  }
+  static std::string get(const char* name, ArgSpan args, size_t i) {
+    return convert(name, i, args[i]);
+  }
+};
+
+template<>
+struct Arg<lref> {
+  static const lref& get(const char*, ArgSpan args, size_t i) { return args[i]; }
+};
+
+template<typename T>
+struct Arg<std::optional<T>> {
+  static std::optional<T> get(const char* name, ArgSpan args, size_t i) {
+    if (i >= args.size) {
+      return std::nullopt;
+    }
+    return Arg<T>::get(name, args, i);
+  }
+};
+
+template<>
+struct Arg<ArgSpan> {
+  static ArgSpan get(const char*, ArgSpan args, size_t i) {
+    return ArgSpan{args.data + i, args.size - i};
+  }
+};
+
+template<typename T>
+struct is_optional : std::false_type {};
+template<typename T>
+struct is_optional<std::optional<T>> : std::true_type {};
+
+template<typename... Params>
+struct Arity {
+  static constexpr bool optional[] = {is_optional<Params>::value..., false};
+  static constexpr bool rest[] = {std::is_same_v<Params, ArgSpan>..., false};
+  static constexpr size_t count = sizeof...(Params);
+  static constexpr bool variadic = count > 0 && rest[count - 1];
+
+  // Everything before the first optional (or the rest span) is required
+  static constexpr size_t min() {
+    size_t i = 0;
+    while (i < count && !optional[i] && !rest[i]) {
+      i++;
+    }
+    return i;
+  }
+
+  static constexpr bool well_formed() {
+    for (size_t i = min(); i < count; i++) {
+      if (rest[i] && i != count - 1) {
+        return false;
+      }
+      if (!optional[i] && !rest[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+inline lref to_lisp(lref value) { return value; }
+inline lref to_lisp(int value) { return make_int(value); }
+inline lref to_lisp(bool value) { return value ? True : False; }
+inline lref to_lisp(std::string value) { return std::make_shared<String>(std::move(value)); }
+inline lref to_lisp(std::string_view value) { return std::make_shared<String>(std::string(value)); }
+
+template<typename F>
+struct Signature : Signature<decltype(&F::operator())> {};
+
+template<typename R, typename C, typename... Params>
+struct Signature<R (C::*)(Params...) const> {
+  using ret = R;
+  using params = std::tuple<std::decay_t<Params>...>;
+};
+
+template<typename R, typename... Params>
+struct Signature<R (*)(Params...)> {
+  using ret = R;
+  using params = std::tuple<std::decay_t<Params>...>;
+};
+
+// Same, minus the callstack at the front
+template<typename F>
+struct CallstackSignature : CallstackSignature<decltype(&F::operator())> {};
+
+template<typename R, typename C, typename... Params>
+struct CallstackSignature<R (C::*)(const lref&, Params...) const> {
+  using params = std::tuple<std::decay_t<Params>...>;
+};
+
+// leading goes to f ahead of the converted args
+template<typename F, typename... Params, size_t... Is, typename... Leading>
+lref call(const char* name, const F& f, ArgSpan args, std::tuple<Params...>*,
+          std::index_sequence<Is...>, const Leading&... leading) {
+  using A = Arity<Params...>;
+  static_assert(A::well_formed(),
+                "Optional params go at the end, and an ArgSpan only goes last");
+
+  if (args.size < A::min() || (!A::variadic && args.size > A::count)) {
+    std::string expected = std::to_string(A::min());
+    if (A::variadic) {
+      expected += " or more";
+    } else if (A::count != A::min()) {
+      expected += " to " + std::to_string(A::count);
+    }
+    throw eval_error(std::string("Wrong number of arguments to ") + name + ": got "
+                     + std::to_string(args.size) + ", expected " + expected);
+  }
+
+  using R = decltype(f(leading..., Arg<Params>::get(name, args, Is)...));
+  if constexpr (std::is_void_v<R>) {
+    f(leading..., Arg<Params>::get(name, args, Is)...);
+    return Nil;
+  } else {
+    return to_lisp(f(leading..., Arg<Params>::get(name, args, Is)...));
+  }
+}
+
+}  // namespace bind_detail
+
+template<typename F>
+LispFunction* bind(const char* name, F f) {
+  using Params = typename bind_detail::Signature<F>::params;
+  auto ret = new LispFunction([name, f](ArgSpan args) -> lref {
+    return bind_detail::call(name, f, args, (Params*)nullptr,
+                             std::make_index_sequence<std::tuple_size_v<Params>>());
+  });
+  ret->name = name;
+  return ret;
+}
+
+template<typename F>
+SecondOrderLispFunction* bind_with_callstack(const char* name, F f) {
+  using Params = typename bind_detail::CallstackSignature<F>::params;
+  return new SecondOrderLispFunction([name, f](lref args, const lref& callstack) -> lref {
+    std::vector<lref> span;
+    for (; args != Nil; args = cdr(args)) {
+      span.push_back(car(args));
+    }
+    return bind_detail::call(name, f, ArgSpan{span.data(), span.size()}, (Params*)nullptr,
+                             std::make_index_sequence<std::tuple_size_v<Params>>(), callstack);
+  });
+}
+
+// Converts one arg the way bind would for a T param. For args a builtin takes as an
+// lref and has to look at first, like ones that can be nil. i is the arg's index,
+// for the error message.
+template<typename T>
+T arg_as(const char* name, size_t i, const lref& arg) {
+  return bind_detail::Arg<T>::convert(name, i, arg);
+}
+
+#endif
@@ -0,0 +1,69 @@
+#include <algorithm>
+
+#include "budget.h"
+
+using std::chrono::steady_clock;
+
+thread_local FuelTank fuel_tank;
+
+bool FuelTank::refill() {
+  if (deadline && steady_clock::now() >= *deadline) {
+    ticks = reserve = 0;
+    return false;
+  }
+  if (!limited) {
+    ticks = deadline ? GEL_FUEL_SLICE - 1 : LONG_MAX;
+    return true;
+  }
+  if (reserve <= 0) {
+    ticks = 0;
+    return false;
+  }
+
+  // With no deadline to check there's no reason to stop before the end
+  long slice = deadline ? std::min(reserve, GEL_FUEL_SLICE) : reserve;
+  reserve -= slice;
+  // One of them is for the tick that got us here
+  ticks = slice - 1;
+  return true;
+}
+
+long FuelTank::left() const {
+  if (!limited) {
+    return LONG_MAX;
+  }
+  return std::max(ticks, 0L) + reserve;
+}
+
+BudgetScope::BudgetScope(const Budget& budget) : previous(fuel_tank) {
+  // Nothing gets to run longer than whatever budget it's already under
+  FuelTank tank;
+  tank.limited = budget.fuel.has_value() || previous.limited;
+  tank.deadline = budget.deadline;
+  if (previous.deadline && (!tank.deadline || *previous.deadline < *tank.deadline)) {
+    tank.deadline = previous.deadline;
+  }
+  if (tank.limited) {
+    tank.reserve = std::max(0L, std::min(budget.fuel.value_or(LONG_MAX), previous.left()));
+  }
+  // Start empty so the first tick refills, which looks at the deadline too
+  if (tank.limited || tank.deadline) {
+    tank.ticks = 0;
+  }
+
+  start = tank.left();
+  fuel_tank = tank;
+}
+
+BudgetScope::~BudgetScope() {
+  long used = start - fuel_tank.left();
+  fuel_tank = previous;
+  if (fuel_tank.limited) {
+    fuel_tank.reserve = std::max(0L, fuel_tank.left() - used);
+    fuel_tank.ticks = 0;
+  }
+}
+
+void out_of_budget() {
+  throw budget_error("Ran out of budget.");
+}
@@ -0,0 +1,75 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <chrono>
+#include <optional>
+
+#include "types.h"
+
+struct budget_error : public lisp_error { using lisp_error::lisp_error; };
+
+/*
+  Budgets, for running scripts inside something like a frame loop that can't wait
+  for them to finish.
+
+  What gets counted is fuel: one for every step of eval, and one for every call,
+  return and backward jump in the VM. Straight line code in between can only be as
+  long as the block it's in, so that's about as good as counting instructions, but
+  the check only goes in places that already branch and it's a decrement and a
+  compare. The deadline only gets looked at every GEL_FUEL_SLICE ticks.
+
+  When a budget runs out, a coroutine run with resume_with_budget stops where it is
+  and can be picked back up later. Anything else, including eval, throws a
+  budget_error. It stays out, so catching that doesn't let a script keep going.
+*/
+const long GEL_FUEL_SLICE = 1000;
+
+struct Budget {
+  // Ticks it can use, or none for no limit
+  std::optional<long> fuel;
+  std::optional<std::chrono::steady_clock::time_point> deadline;
+
+  static Budget for_time(std::chrono::steady_clock::duration duration) {
+    return Budget{std::nullopt, std::chrono::steady_clock::now() + duration};
+  }
+};
+
+// The budget a thread is running under right now. ticks is what the hot paths
+// decrement; refill gets called whenever it goes below zero.
+struct FuelTank {
+  long ticks = LONG_MAX;
+  // Fuel left beyond what's in ticks
+  long reserve = 0;
+  bool limited = false;
+  std::optional<std::chrono::steady_clock::time_point> deadline;
+
+  // False if the budget's used up, and ticks stays empty so the next tick is too
+  bool refill();
+  // How much fuel is left all told. LONG_MAX if there's no limit.
+  long left() const;
+};
+
+extern thread_local FuelTank fuel_tank;
+
+// Uses one tick. False once the budget's used up.
+inline bool fuel_tick() {
+  return --fuel_tank.ticks >= 0 || fuel_tank.refill();
+}
+
+// Runs under a budget until it goes away, then charges whatever got used to the
+// budget that was there before
+class BudgetScope {
+  public:
+    BudgetScope(const Budget& budget);
+    BudgetScope(const BudgetScope&) = delete;
+    BudgetScope& operator=(const BudgetScope&) = delete;
+    ~BudgetScope();
+  private:
+    FuelTank previous;
+    long start;
+};
+
+// Throws the budget_error for running out
+[[noreturn]] void out_of_budget();
+
+#endif
@@ -1,9 +1,21 @@
-#include <fstream>
-#include <tuple>
-
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+
+#include "bind.h"
+#include "budget.h"
 #include "builtin.h"
+#include "cache.h"
 #include "evaluator.h"
+#include "image.h"
+#include "interpreter.h"
+#include "jit.h"
+#include "pool.h"
+#include "port.h"
 #include "reader.h"
+#include "regvm.h"
 #include "vm.h"
 
 #define UNREFERENCED(var) (void)(var);
@@ -16,117 +28,261 @@ void check_num_args(const lref& arglist, int size) {
   }
 }
 
+void check_num_args(ArgSpan args, int size) {
+  if ((int)args.size != size) {
+    std::string reprs = "(";
+    for (size_t i = 0; i < args.size; i++) {
+      reprs += (i == 0 ? "" : " ") + try_repr(args[i]);
+    }
+    throw eval_error("Wrong number of arguments: "
+                     + reprs + "), expected "
+                     + std::to_string(size));
+  }
+}
+
 lref next(lref& lst) {
   lref ret = car(lst);
   lst = cdr(lst);
   return ret;
 }
 
-template<typename base_type>
-lref to_lisp(base_type);
-
-template<typename base_type>
-base_type from_lisp(lref arg);
+// Folds op over the args, which all have to be ints.
+// name is only for error messages.
+template<typename Op>
+lref fold_ints(ArgSpan args, const char* const name, LispInt sum, size_t start, Op op) {
+  for (size_t i = start; i < args.size; i++) {
+    auto rhs = dynamic_cast<const LispInt*>(args[i].get());
+    if (rhs == nullptr) {
+      throw lisp_error(std::string("Argument to ") + name + " is not an int: "
+                       + try_repr(args[i]));
+    }
+    op(sum, *rhs);
+  }
 
-template<>
-lref to_lisp(int i) {
-  return std::make_shared<LispInt>(i);
+  return make_int(sum.val);
 }
 
-template<>
-int from_lisp(lref arg) {
-  auto ret = std::dynamic_pointer_cast<LispInt>(arg);
-  if (ret.get() == nullptr) {
-    throw eval_error("Failed conversion.");
+// The first arg of - // and * is where the fold starts
+const LispInt& first_int(ArgSpan args, const char* const name) {
+  if (args.size == 0) {
+    throw eval_error(std::string("Too few arguments to ") + name);
   }
-  return ret.get()->val;
-}
 
-template<typename return_type, typename... template_args>
-LispFunction* wrap_func (std::function<return_type(template_args...)> wrapped_func) {
-  return new LispFunction([wrapped_func](lref args) -> lref {
-    const int n_args = sizeof...(template_args);
-    check_num_args(args, n_args);
-    std::tuple<template_args...> to_pass = { (from_lisp<template_args>(next(args)))... };
-    return to_lisp(std::apply(wrapped_func, to_pass));
-  });
+  auto lhs = dynamic_cast<const LispInt*>(args[0].get());
+  if (lhs == nullptr) {
+    throw lisp_error(std::string("Argument to ") + name + " is not an int: "
+                     + try_repr(args[0]));
+  }
+  return *lhs;
 }
 
-LispFunction* plus = new LispFunction([](lref args) -> lref {
-  LispInt sum = 0;
+LispFunction* plus = new LispFunction([](ArgSpan args) -> lref {
+  return fold_ints(args, "+", 0, 0, [](LispInt& sum, const LispInt& rhs) { sum += rhs; });
+});
 
-  while(args != Nil) {
-    auto rhs = std::dynamic_pointer_cast<LispInt>(car(args)).get();
-    if (rhs == nullptr) {
-      throw lisp_error("Argument to + is not an int: " + try_repr(car(args)));
-    }
-    sum += *rhs;
-    args = cdr(args);
-  }
+LispFunction* minus = new LispFunction([](ArgSpan args) -> lref {
+  return fold_ints(args, "-", first_int(args, "-"), 1,
+                   [](LispInt& sum, const LispInt& rhs) { sum -= rhs; });
+});
 
-  return std::make_shared<LispInt>(sum);
+LispFunction* int_divide = new LispFunction([](ArgSpan args) -> lref {
+  return fold_ints(args, "//", first_int(args, "//"), 1,
+                   [](LispInt& sum, const LispInt& rhs) { sum /= rhs; });
 });
 
-LispFunction* minus = new LispFunction([](lref args) -> lref {
-  LispInt sum = 0;
+LispFunction* mult = new LispFunction([](ArgSpan args) -> lref {
+  return fold_ints(args, "*", first_int(args, "*"), 1,
+                   [](LispInt& sum, const LispInt& rhs) { sum *= rhs; });
+});
 
-  sum += *((LispInt*)(car(args).get()));
-  args = cdr(args);
+LispFunction* modulo = new LispFunction([](ArgSpan args) -> lref {
+  check_num_args(args, 2);
+  auto lhs = dynamic_cast<const LispInt*>(args[0].get());
+  if (lhs == nullptr) {
+    throw lisp_error("Argument to % is not an int: " + try_repr(args[0]));
+  }
 
-  while(args != Nil) {
-    auto rhs = std::dynamic_pointer_cast<LispInt>(car(args)).get();
-    if (rhs == nullptr) {
-      throw lisp_error("Argument to - is not an int: " + try_repr(car(args)));
-    }
-    sum -= *rhs;
-    args = cdr(args);
+  auto rhs = dynamic_cast<const LispInt*>(args[1].get());
+  if (rhs == nullptr) {
+    throw lisp_error("Argument to % is not an int: " + try_repr(args[1]));
   }
 
-  return std::make_shared<LispInt>(sum);
+  return make_int((*lhs % *rhs).val);
 });
 
-LispFunction* int_divide = new LispFunction([](lref args) -> lref {
-  LispInt sum = *((LispInt*)(car(args).get()));
-  args = cdr(args);
+// What clock counts from
+static const auto startup_time = std::chrono::steady_clock::now();
 
-  while(args != Nil) {
-    auto rhs = std::dynamic_pointer_cast<LispInt>(car(args)).get();
-    if (rhs == nullptr) {
-      throw lisp_error("Argument to // is not an int: " + try_repr(car(args)));
-    }
-    sum /= *rhs;
-    args = cdr(args);
+// prn and put write straight into the current port's buffer, see port.h
+// Only bothers with the lock when there could be another thread
+static std::unique_lock<std::mutex> lock_output() {
+  std::unique_lock<std::mutex> lock(current_output->lock, std::defer_lock);
+  if (Gel_in_parallel) {
+    lock.lock();
   }
+  return lock;
+}
 
-  return std::make_shared<LispInt>(sum);
+LispFunction* prn = bind("prn", [](ArgSpan args) {
+  auto lock = lock_output();
+  for (size_t i = 0; i < args.size; i++) {
+    current_output->write(args[i]);
+  }
+  current_output->write(std::string_view("\n"));
 });
 
-LispFunction* mult = new LispFunction([](lref args) -> lref {
-  LispInt sum = *((LispInt*)(car(args).get()));
-  args = cdr(args);
+std::shared_ptr<OutputPort> port_arg(const lref& arg) {
+  auto port = std::dynamic_pointer_cast<OutputPort>(arg);
+  if (port == nullptr) {
+    throw eval_error("Not an output port: " + try_repr(arg));
+  }
+  return port;
+}
 
-  while(args != Nil) {
-    auto rhs = std::dynamic_pointer_cast<LispInt>(car(args)).get();
-    if (rhs == nullptr) {
-      throw lisp_error("Argument to * is not an int: " + try_repr(car(args)));
-    }
-    sum *= *rhs;
-    args = cdr(args);
+/*
+  (with-output port f)
+  Calls f with no args, with prn and put going to port instead. Doesn't flush port.
+*/
+SecondOrderLispFunction* with_output = new SecondOrderLispFunction([](lref args, const lref& callstack) -> lref {
+  check_num_args(args, 2);
+  auto port = port_arg(car(args));
+  auto func = cadr(args);
+  auto as_fn_return = std::dynamic_pointer_cast<FnReturn>(func).get();
+
+  // Put the old port back even if f throws
+  struct Restore {
+    std::shared_ptr<OutputPort> old;
+    ~Restore() { current_output = old; }
+  } restore{current_output};
+
+  current_output = port;
+  return apply(func, Nil, as_fn_return != nullptr ? as_fn_return->env : current_env, callstack);
+});
+
+// Either can be nil for no limit on it. i is where fuel is in name's args.
+static Budget budget_arg(const char* name, size_t i, const lref& fuel, const lref& ms) {
+  Budget budget;
+  if (fuel != Nil) {
+    budget.fuel = arg_as<int>(name, i, fuel);
+  }
+  if (ms != Nil) {
+    budget.deadline = std::chrono::steady_clock::now()
+      + std::chrono::milliseconds(arg_as<int>(name, i + 1, ms));
   }
+  return budget;
+}
+
+/*
+  (call-with-budget fuel ms f)
+  Calls f with no args, and throws if it uses more than fuel ticks or runs for
+  longer than ms milliseconds. See budget.h for what a tick is.
+*/
+SecondOrderLispFunction* call_with_budget = bind_with_callstack("call-with-budget",
+    [](const lref& callstack, const lref& fuel, const lref& ms, const lref& func) -> lref {
+  auto budget = budget_arg("call-with-budget", 0, fuel, ms);
+  auto as_fn_return = std::dynamic_pointer_cast<FnReturn>(func).get();
 
-  return std::make_shared<LispInt>(sum);
+  BudgetScope scope(budget);
+  return apply(func, Nil, as_fn_return != nullptr ? as_fn_return->env : current_env, callstack);
 });
 
-LispFunction* prn = new LispFunction([](lref args) -> lref {
-  std::string to_print = "";
-  while(args != Nil) {
-    to_print += try_str(car(args));
-    args = cdr(args);
+// Calls any kind of function: a user function, compiled code or a builtin
+static lref call_function(const lref& func, ArgSpan args, const lref& callstack) {
+  if (auto fn_return = dynamic_cast<FnReturn*>(func.get())) {
+    lref arglist = Nil;
+    for (size_t i = args.size; i-- > 0;) {
+      arglist = cons(args[i], arglist);
+    }
+    return apply(func, arglist, fn_return->env, callstack);
   }
+  if (dynamic_cast<Bytecode*>(func.get()) != nullptr) {
+    return call_bytecode(func, args);
+  }
+  return call_builtin(func, args.data, args.size);
+}
 
-  std::cout << to_print << std::endl;
+// Runs body over [0, n) on the pool, with this interpreter lent to every thread
+// that helps. Under a budget it all stays on this thread, so the budget can keep
+// count of it.
+static void run_parallel(size_t n, const std::function<void(size_t, size_t)>& body) {
+  auto state = share_current_state();
+  auto shared_body = [&](size_t begin, size_t end) {
+    SharedScope scope(state);
+    body(begin, end);
+  };
+  if (fuel_tank.limited || fuel_tank.deadline) {
+    shared_body(0, n);
+    return;
+  }
+  // Enough chunks that there's something to steal when they take uneven time
+  parallel_for(n, n / (pool_size() * 8), shared_body);
+}
 
-  return Nil;
+static std::vector<lref> list_elements(lref lst) {
+  std::vector<lref> ret;
+  for (; lst != Nil; lst = cdr(lst)) {
+    ret.push_back(car(lst));
+  }
+  return ret;
+}
+
+/*
+  (pmap fn lst)
+  mapcar, but spread over the threads in the pool (see pool.h). fn gets called on
+  lots of elements at once, so it shouldn't change anything the other calls can
+  see, and it can't define or set globals at all.
+*/
+SecondOrderLispFunction* pmap = new SecondOrderLispFunction([](lref args, const lref& callstack) -> lref {
+  check_num_args(args, 2);
+  auto func = car(args);
+  auto elements = list_elements(cadr(args));
+  std::vector<lref> results(elements.size());
+
+  run_parallel(elements.size(), [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      results[i] = call_function(func, ArgSpan{&elements[i], 1}, callstack);
+    }
+  });
+
+  lref ret = Nil;
+  for (size_t i = results.size(); i-- > 0;) {
+    ret = cons(results[i], ret);
+  }
+  return ret;
+});
+
+/*
+  (preduce fn init lst)
+  Same answer as (fn (fn (fn init a) b) c) and so on, as long as fn is
+  associative. Each chunk of lst gets folded on its own thread, then the results
+  get folded together in order, starting from init. Same rules as pmap for fn.
+*/
+SecondOrderLispFunction* preduce = new SecondOrderLispFunction([](lref args, const lref& callstack) -> lref {
+  check_num_args(args, 3);
+  auto func = car(args);
+  auto elements = list_elements(car(cddr(args)));
+
+  // What each chunk came to, keyed by where it started
+  std::mutex lock;
+  std::vector<std::pair<size_t, lref>> partials;
+  run_parallel(elements.size(), [&](size_t begin, size_t end) {
+    lref acc = elements[begin];
+    for (size_t i = begin + 1; i < end; i++) {
+      lref pair[] = {acc, elements[i]};
+      acc = call_function(func, ArgSpan{pair, 2}, callstack);
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    partials.push_back({begin, acc});
+  });
+
+  std::sort(partials.begin(), partials.end(),
+            [](const auto& a, const auto& b) { return a.first < b.first; });
+  lref acc = cadr(args);
+  for (const auto& partial : partials) {
+    lref pair[] = {acc, partial.second};
+    acc = call_function(func, ArgSpan{pair, 2}, callstack);
+  }
+  return acc;
 });
 
 LispFunction* _repr = new LispFunction([](lref args) -> lref {
@@ -138,51 +294,50 @@ LispFunction* list = new LispFunction([](lref args) -> lref {
   return args;
 });
 
-LispFunction* _cons = new LispFunction([](lref args) -> lref {
+LispFunction* _cons = new LispFunction([](ArgSpan args) -> lref {
   check_num_args(args, 2);
-  return cons(car(args), cadr(args));
+  return cons(args[0], args[1]);
 });
 
-LispFunction* consp = new LispFunction([](lref args) -> lref {
+LispFunction* consp = new LispFunction([](ArgSpan args) -> lref {
   check_num_args(args, 1);
-  return std::dynamic_pointer_cast<Cons>(car(args)) ? True : False;
+  return dynamic_cast<const Cons*>(args[0].get()) ? True : False;
 });
 
-LispFunction* emptyp = new LispFunction([](lref args) -> lref {
+LispFunction* emptyp = new LispFunction([](ArgSpan args) -> lref {
   check_num_args(args, 1);
-  return car(args) == Nil ? True : False;
+  return args[0] == Nil ? True : False;
 });
 
-LispFunction* _len = new LispFunction([](lref args) -> lref {
+LispFunction* _len = new LispFunction([](ArgSpan args) -> lref {
   check_num_args(args, 1);
-  return std::make_shared<LispInt>(len(car(args)));
+  return make_int(len(args[0]));
 });
 
-LispFunction* equals = new LispFunction([](lref args) -> lref {
+LispFunction* equals = new LispFunction([](ArgSpan args) -> lref {
   check_num_args(args, 2);
-  return car(args).get()->equals(cadr(args)) ? True : False;
+  return args[0]->equals(args[1]) ? True : False;
 });
 
-LispFunction* lt = new LispFunction([](lref args) -> lref {
+// Shared by < and >
+template<typename Compare>
+lref compare_ints(ArgSpan args, Compare compare) {
   check_num_args(args, 2);
-  auto arg1 = std::dynamic_pointer_cast<LispInt>(car(args)).get();
-  auto arg2 = std::dynamic_pointer_cast<LispInt>(cadr(args)).get();
+  auto arg1 = dynamic_cast<const LispInt*>(args[0].get());
+  auto arg2 = dynamic_cast<const LispInt*>(args[1].get());
   if (arg1 == nullptr || arg2 == nullptr) {
     throw eval_error("Bad argument types: "
-                     + try_repr(car(args)) + " " + try_repr(cadr(args)));
+                     + try_repr(args[0]) + " " + try_repr(args[1]));
   }
-  return arg1->lt(cadr(args)) ? True : False;
+  return compare(arg1->val, arg2->val) ? True : False;
+}
+
+LispFunction* lt = new LispFunction([](ArgSpan args) -> lref {
+  return compare_ints(args, [](int a, int b) { return a < b; });
 });
 
-LispFunction* gt = new LispFunction([](lref args) -> lref {
-  check_num_args(args, 2);
-  auto arg1 = std::dynamic_pointer_cast<LispInt>(car(args)).get();
-  auto arg2 = std::dynamic_pointer_cast<LispInt>(cadr(args)).get();
-  if (arg1 == nullptr || arg2 == nullptr) {
-    throw eval_error("Bad argument types: "
-                     + try_repr(car(args)) + " " + try_repr(cadr(args)));
-  }
-  return arg1->gt(cadr(args)) ? True : False;
+LispFunction* gt = new LispFunction([](ArgSpan args) -> lref {
+  return compare_ints(args, [](int a, int b) { return a > b; });
 });
 
 /*
@@ -217,6 +372,16 @@ SecondOrderLispFunction* _mapcar = new SecondOrderLispFunction([](lref args, con
   Read a string into a lisp form.
 */
 LispFunction* read_string = new LispFunction([](lref args) -> lref {
+  // Don't copy it if there's only one
+  if (args != Nil && cdr(args) == Nil) {
+    auto str = std::dynamic_pointer_cast<String>(car(args)).get();
+    if (str == nullptr) {
+      throw eval_error("Bad argument type: " + try_repr(car(args)));
+    }
+    auto ast = read(str->value);
+    return ast.get() != nullptr ? ast : Nil;
+  }
+
   std::string ret = "";
   while (args != Nil) {
     auto str = std::dynamic_pointer_cast<String>(car(args)).get();
@@ -226,7 +391,7 @@ LispFunction* read_string = new LispFunction([](lref args) -> lref {
     ret += str->value;
     args = cdr(args);
   }
-  auto ast = read(ret.c_str());
+  auto ast = read(ret);
   return ast.get() != nullptr ? ast : Nil;
 });
 
@@ -251,32 +416,16 @@ LispFunction* read_string_with_filename = new LispFunction([](lref args) -> lref
     ret += str->value;
     args = cdr(args);
   }
-  auto ast = read(ret.c_str(), path->value);
+  auto ast = read(ret, std::string(path->value));
   return ast.get() != nullptr ? ast : Nil;
 });
 
 /*
-  Read a file into a string.
+  Read a file into a string. substr slices share its chars instead of copying
+  them.
 */
-LispFunction* slurp = new LispFunction([](lref args) -> lref {
-  check_num_args(args, 1);
-  auto s = std::dynamic_pointer_cast<String>(car(args)).get();
-
-  if (s == nullptr) {
-    throw eval_error("Bad argument type: Argument should be a string: "
-                     + try_repr(car(args)));
-  }
-    
-  std::ifstream file(s->value);
-
-  if (!file.is_open()) {
-    throw lisp_error("File " + s->value + " does not exist.");
-  }
-    
-  // https://stackoverflow.com/questions/2912520/read-file-contents-into-a-string-in-c
-  return std::make_shared<String>(
-    std::string((std::istreambuf_iterator<char>(file)),
-                (std::istreambuf_iterator<char>())));
+LispFunction* slurp = bind("slurp", [](std::string path) {
+  return slurp_file(path);
 });
 
 /*
@@ -304,20 +453,240 @@ SecondOrderLispFunction* _eval = new SecondOrderLispFunction([](lref args, const
   return ret;
 });
 
+std::shared_ptr<ReaderObject> reader_arg(const lref& arg) {
+  auto reader = std::dynamic_pointer_cast<ReaderObject>(arg);
+  if (reader == nullptr) {
+    throw eval_error("Not a reader: " + try_repr(arg));
+  }
+  return reader;
+}
+
+// Expanding a whole form up front only saves eval from expanding the same code
+// over and over. If it fails, eval gets the form as it is, so the error comes out
+// when the code runs and whatever try is around it can catch it.
+static lref expand_toplevel(const lref& form) {
+  try {
+    return macroexpand_recursive(current_env, form);
+  } catch (const lisp_error&) {
+    return form;
+  }
+}
+
+/*
+  Read and eval a file one top level form at a time, so the whole file never
+  has to be in memory at once. Each form is macroexpanded right before it runs,
+  so macros defined earlier in the file work later in it.
+
+  The loop is here instead of in lisp so that it doesn't grow the stack or the
+  env on big files.
+*/
+SecondOrderLispFunction* eval_file = bind_with_callstack("eval-file",
+    [](const lref& callstack, const std::string& path) {
+  auto reader = open_reader(path);
+  for (auto form = read_next(*reader); form != nullptr; form = read_next(*reader)) {
+    form = expand_toplevel(form);
+    eval(current_env, form, callstack);
+  }
+  return Nil;
+});
+
+/*
+  Evals a file for import, going through the import cache (see cache.h).
+  next_form hands out the file's forms as they were read, nullptr at the end, and
+  only gets called on a miss. On a miss each form gets saved as soon as it's
+  expanded, so only the one form's ever in memory, same as eval-file.
+*/
+static void import_forms(const std::string& path, const std::function<lref()>& next_form,
+                         const lref& callstack) {
+  import_cache_note(path);
+  auto key = import_cache_key(path, current_env);
+
+  auto cached = import_cache_load(path, key);
+  if (cached != nullptr) {
+    for (auto form = cached->next(); form != nullptr; form = cached->next()) {
+      eval(current_env, form, callstack);
+    }
+    return;
+  }
+
+  ImportDeps deps;
+  auto entry = import_cache_writer(path, key);
+  for (auto form = next_form(); form != nullptr; form = next_form()) {
+    form = expand_toplevel(form);
+    if (entry != nullptr) {
+      try {
+        entry->add(form);
+      } catch (const image_error&) {
+        import_cache_stats.failed_stores++;
+        entry = nullptr;
+      }
+    }
+    eval(current_env, form, callstack);
+  }
+
+  if (entry != nullptr) {
+    import_cache_commit(path, key, *entry, deps);
+  }
+}
+
+// Evals a file from compile-file. Its forms are already expanded.
+static void import_image(const std::string& path, const lref& callstack) {
+  // What's really being depended on is the source. If it changes, the image will
+  // be out of date, and import will go back to that.
+  auto source = path.substr(0, path.size() - 1);
+  std::error_code ec;
+  if (path.size() > 1 && path.back() == 'c' && std::filesystem::exists(source, ec)) {
+    import_cache_note(source);
+  } else {
+    import_cache_note(path);
+  }
+
+  ImageFileReader reader(path);
+  for (auto form = reader.next(); form != nullptr; form = reader.next()) {
+    eval(current_env, form, callstack);
+  }
+}
+
+SecondOrderLispFunction* _import_image = bind_with_callstack("import-image",
+    [](const lref& callstack, const std::string& path) {
+  import_image(path, callstack);
+});
+
+std::string compile_file(const std::string& source, const lref& callstack) {
+  auto path = source + "c";
+  ImageFileWriter out(path);
+  auto reader = open_reader(source);
+  for (auto form = read_next(*reader); form != nullptr; form = read_next(*reader)) {
+    form = expand_toplevel(form);
+    out.add(form);
+    eval(current_env, form, callstack);
+  }
+  out.commit();
+  return path;
+}
+
+SecondOrderLispFunction* import_file = bind_with_callstack("import-file",
+    [](const lref& callstack, const std::string& path) {
+  std::unique_ptr<Reader> reader;
+  import_forms(path, [&]() {
+    if (reader == nullptr) {
+      reader = open_reader(path);
+    }
+    return read_next(*reader);
+  }, callstack);
+  return Nil;
+});
+
+/*
+  Imports files in order, but reads them all at once on a pool of threads first,
+  so only evaling them is left for this thread. Files with an up to date .gelc
+  load that instead, the same as import.
+*/
+SecondOrderLispFunction* import_all = bind_with_callstack("import-all",
+    [](const lref& callstack, ArgSpan args) {
+  std::vector<std::string> paths;
+  std::vector<std::string> sources;
+  for (size_t i = 0; i < args.size; i++) {
+    auto path = arg_as<std::string>("import-all", i, args[i]);
+    paths.push_back(path);
+    if (!image_up_to_date(path + "c", path)) {
+      sources.push_back(path);
+    }
+  }
+
+  ParallelReader reader(sources);
+  size_t next_source = 0;
+  for (const auto& path : paths) {
+    if (next_source == sources.size() || sources[next_source] != path) {
+      import_image(path + "c", callstack);
+      continue;
+    }
+
+    // On a cache hit this file got read for nothing, but that happened on another
+    // thread anyway
+    auto forms = reader.get(next_source++);
+    import_forms(path, [&]() {
+      if (forms == Nil) {
+        return lref(nullptr);
+      }
+      auto form = car(forms);
+      forms = cdr(forms);
+      return form;
+    }, callstack);
+  }
+  return Nil;
+});
+
+LispFunction* read_files = bind("read-files", [](ArgSpan args) -> lref {
+  std::vector<std::string> paths;
+  for (size_t i = 0; i < args.size; i++) {
+    paths.push_back(arg_as<std::string>("read-files", i, args[i]));
+  }
+
+  ParallelReader reader(paths);
+  lref ret = Nil;
+  for (size_t i = paths.size(); i-- > 0;) {
+    ret = cons(reader.get(i), ret);
+  }
+  return ret;
+});
+
+/*
+  (eval-isolated source ...)
+  Evals each string in a new interpreter of its own, all at once, each on its own
+  thread. Returns what the last form in each one returned, in order. They only
+  start out with the builtins; (load-file "init.gel") gets one the stdlib.
+  If any of them throws, this throws the first one's error once they're all done.
+*/
+LispFunction* eval_isolated = bind("eval-isolated", [](ArgSpan args) -> lref {
+  std::vector<std::string> sources;
+  for (size_t i = 0; i < args.size; i++) {
+    sources.push_back(arg_as<std::string>("eval-isolated", i, args[i]));
+  }
+
+  std::vector<lref> results(sources.size());
+  std::vector<std::exception_ptr> errors(sources.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < sources.size(); i++) {
+    threads.emplace_back([&, i]() {
+      try {
+        Interpreter interpreter;
+        results[i] = interpreter.eval(sources[i]);
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (const auto& error : errors) {
+    if (error != nullptr) {
+      std::rethrow_exception(error);
+    }
+  }
+  lref ret = Nil;
+  for (size_t i = results.size(); i-- > 0;) {
+    ret = cons(results[i], ret);
+  }
+  return ret;
+});
+
 // Concatenate two lists.
 LispFunction* _concat = new LispFunction([](lref args) -> lref {
   check_num_args(args, 2);
   return concat(car(args), cadr(args));
 });
 
-LispFunction* _car = new LispFunction([](lref args) -> lref {
+LispFunction* _car = new LispFunction([](ArgSpan args) -> lref {
   check_num_args(args, 1);
-  return car(car(args));
+  return car(args[0]);
 });
 
-LispFunction* _cdr = new LispFunction([](lref args) -> lref {
+LispFunction* _cdr = new LispFunction([](ArgSpan args) -> lref {
   check_num_args(args, 1);
-  return cdr(car(args));
+  return cdr(args[0]);
 });
 
 LispFunction* _last = new LispFunction([](lref args) -> lref {
@@ -369,7 +738,7 @@ LispFunction* _throw = new LispFunction([](lref args) -> lref {
 });
 
 
-lref repl_env = std::shared_ptr<Map>(new Map({
+const lref builtin_table = std::shared_ptr<Map>(new Map({
     {"-def-internal!", new LispFunction([](lref args) -> lref {
       check_num_args(args, 2);
 
@@ -403,34 +772,55 @@ lref repl_env = std::shared_ptr<Map>(new Map({
     {"-", minus},
     {"*", mult},
     {"//", int_divide},
-    {"%", new LispFunction([](lref args) -> lref {
-      check_num_args(args, 2);
-      auto lhs = std::dynamic_pointer_cast<LispInt>(car(args)).get();
-      if (lhs == nullptr) {
-        throw lisp_error("Argument to % is not an int: " + try_repr(car(args)));
+    {"%", modulo},
+    {"prn", prn},
+    {"put", bind("put", [](ArgSpan args) {
+      auto lock = lock_output();
+      for (size_t i = 0; i < args.size; i++) {
+        current_output->write(args[i]);
       }
-
-      auto rhs = std::dynamic_pointer_cast<LispInt>(cadr(args)).get();
-      if (rhs == nullptr) {
-        throw lisp_error("Argument to % is not an int: " + try_repr(cadr(args)));
+    })},
+    {"flush", bind("flush", [](std::optional<lref> port) {
+      (port ? port_arg(*port) : current_output)->flush();
+    })},
+    {"open-output-file", bind("open-output-file", [](std::string path) -> lref {
+      return open_output_file(path);
+    })},
+    {"open-output-string", bind("open-output-string", []() -> lref {
+      return std::make_shared<StringPort>();
+    })},
+    {"port-string", bind("port-string", [](const lref& port) {
+      auto as_string_port = dynamic_cast<StringPort*>(port.get());
+      if (as_string_port == nullptr) {
+        throw eval_error("Not a string port: " + try_repr(port));
       }
-
-      return std::make_shared<LispInt>(*lhs % *rhs);
+      return std::string_view(as_string_port->contents());
     })},
-    {"prn", prn},
-    {"put", new LispFunction([](lref args) -> lref {
-      std::string to_print = "";
-      while(args != Nil) {
-        to_print += try_str(car(args));
-        args = cdr(args);
+    {"close-port", bind("close-port", [](const lref& port) {
+      // Closing a string port doesn't do anything
+      auto as_file_port = std::dynamic_pointer_cast<FilePort>(port_arg(port));
+      if (as_file_port != nullptr) {
+        as_file_port->close();
       }
-
-      std::cout << to_print;
-
-      return Nil;
     })},
+    {"with-output", with_output},
+    {"call-with-budget", call_with_budget},
     {"repr", _repr},
     {"list", list},
+    // (list* a b rest) is (cons a (cons b rest))
+    {"list*", bind("list*", [](ArgSpan args) -> lref {
+      if (args.size == 0) {
+        throw eval_error("Wrong number of arguments to list*: got 0, expected 1 or more");
+      }
+      lref ret = args[args.size - 1];
+      for (size_t i = args.size - 1; i > 0; i--) {
+        ret = cons(args[i - 1], ret);
+      }
+      return ret;
+    })},
+    {"append", bind("append", [](const lref& lst, const lref& tail) {
+      return append(lst, tail);
+    })},
     {"cons", _cons},
     {"cons?", consp},
     {"empty?", emptyp},
@@ -439,6 +829,22 @@ lref repl_env = std::shared_ptr<Map>(new Map({
     {"<", lt},
     {">", gt},
     {"mapcar", _mapcar},
+    {"pmap", pmap},
+    {"preduce", preduce},
+    {"pool-size", bind("pool-size", pool_size)},
+    {"set-pool-size!", bind("set-pool-size!", [](int size) {
+      if (Gel_in_parallel) {
+        throw eval_error("Can't resize the pool inside pmap or preduce.");
+      }
+      set_pool_size(size);
+    })},
+    {"pool-stats", new LispFunction([](lref args) -> lref {
+      check_num_args(args, 0);
+      auto ret = std::make_shared<Map>();
+      ret->set(std::make_shared<Symbol>("parallel"), make_int(pool_stats.parallel));
+      ret->set(std::make_shared<Symbol>("serial"), make_int(pool_stats.serial));
+      return ret;
+    })},
     {"read-string", read_string},
     {"read-string-with-filename", read_string_with_filename},
     {"slurp", slurp},
@@ -496,6 +902,11 @@ lref repl_env = std::shared_ptr<Map>(new Map({
       if (f == nullptr) {
         throw lisp_error("First argument to set-function-name is not a function.");
       }
+      // Builtins are the same objects in every interpreter, so renaming one would
+      // rename it everywhere, while other threads might be reading the name
+      if (dynamic_cast<LispFunction*>(f.get()) != nullptr) {
+        throw lisp_error("Can't rename builtin " + f->name + ".");
+      }
 
       auto s = std::dynamic_pointer_cast<String>(cadr(args));
       if (s == nullptr) {
@@ -510,6 +921,25 @@ lref repl_env = std::shared_ptr<Map>(new Map({
       UNREFERENCED(args);
       return std::make_shared<LispInt>(rand());
     })},
+    {"string-length", bind("string-length", [](std::string_view str) {
+      return (int)str.size();
+    })},
+    // (substr s start end), end defaults to the end of s. Shares s's chars
+    // instead of copying them, see slice_string.
+    {"substr", bind("substr", [](const lref& str, int start, std::optional<int> end) {
+      auto as_string = std::dynamic_pointer_cast<String>(str);
+      if (as_string == nullptr) {
+        throw eval_error("Not a string: " + try_repr(str));
+      }
+      int size = as_string->value.size();
+      int stop = end.value_or(size);
+      if (start < 0 || stop < start || stop > size) {
+        throw eval_error("Bad range for substr: " + std::to_string(start) + " to "
+                         + std::to_string(stop) + " in a string of length "
+                         + std::to_string(size));
+      }
+      return slice_string(as_string, start, stop);
+    })},
     {"strcat", new LispFunction([](lref args) {
       std::string ret = "";
       while(args != Nil) {
@@ -527,7 +957,7 @@ lref repl_env = std::shared_ptr<Map>(new Map({
         return False;
       }
 
-      std::string last_str = last_ptr->value;
+      auto last_str = last_ptr->value;
 
       args = cdr(args);
 
@@ -537,7 +967,7 @@ lref repl_env = std::shared_ptr<Map>(new Map({
           return False;
         }
 
-        std::string cur_str = cur_ptr->value;
+        auto cur_str = cur_ptr->value;
         if (cur_str != last_str) {
           return False;
         }
@@ -556,12 +986,147 @@ lref repl_env = std::shared_ptr<Map>(new Map({
     })},
     {"assemble", new LispFunction([](lref args) {
       check_num_args(args, 1);
-      return std::make_shared<Bytecode>(assemble(car(args)));
+      auto ret = assemble(car(args));
+      verify(*ret);
+      return ret;
     })},
     {"run-bytecode", new LispFunction([](lref args) {
       check_num_args(args, 1);
       return run_bytecode(car(args));
     })},
+    {"make-coroutine", new LispFunction([](ArgSpan args) -> lref {
+      if (args.size == 0) {
+        throw eval_error("make-coroutine requires the code to run.");
+      }
+      return make_coroutine(args[0], ArgSpan{args.data + 1, args.size - 1});
+    })},
+    {"resume", new LispFunction([](ArgSpan args) -> lref {
+      if (args.size != 1 && args.size != 2) {
+        throw eval_error("resume takes a coroutine and optionally a value to resume it with.");
+      }
+      auto coroutine = dynamic_cast<Coroutine*>(args[0].get());
+      if (coroutine == nullptr) {
+        throw eval_error("Not a coroutine: " + try_repr(args[0]));
+      }
+      return resume(*coroutine, args.size == 2 ? args[1] : Nil);
+    })},
+    // (resume-with-budget coroutine fuel ms value) stops it where it is if it runs
+    // out, and returns nil with coroutine-out-of-fuel? true
+    {"resume-with-budget", bind("resume-with-budget", [](const lref& co, const lref& fuel,
+                                                         const lref& ms,
+                                                         std::optional<lref> value) {
+      auto coroutine = dynamic_cast<Coroutine*>(co.get());
+      if (coroutine == nullptr) {
+        throw eval_error("Not a coroutine: " + try_repr(co));
+      }
+      return resume_with_budget(*coroutine, value.value_or(Nil), budget_arg("resume-with-budget", 1, fuel, ms));
+    })},
+    {"coroutine-out-of-fuel?", bind("coroutine-out-of-fuel?", [](const lref& co) {
+      auto coroutine = dynamic_cast<Coroutine*>(co.get());
+      if (coroutine == nullptr) {
+        throw eval_error("Not a coroutine: " + try_repr(co));
+      }
+      return coroutine->out_of_fuel;
+    })},
+    {"coroutine-done?", new LispFunction([](lref args) -> lref {
+      check_num_args(args, 1);
+      auto coroutine = std::dynamic_pointer_cast<Coroutine>(car(args));
+      if (coroutine == nullptr) {
+        throw eval_error("Not a coroutine: " + try_repr(car(args)));
+      }
+      return coroutine->status == Coroutine::Status::DEAD ? True : False;
+    })},
+    {"set-jit-threshold!", bind("set-jit-threshold!", [](int threshold) {
+      jit_threshold = threshold;
+    })},
+    {"jit-supported?", bind("jit-supported?", jit_supported)},
+    {"jit-compiled?", new LispFunction([](lref args) -> lref {
+      check_num_args(args, 1);
+      auto code = std::dynamic_pointer_cast<Bytecode>(car(args));
+      if (code == nullptr) {
+        throw eval_error("Not bytecode: " + try_repr(car(args)));
+      }
+      return code->jit_code.load(std::memory_order_acquire) != nullptr ? True : False;
+    })},
+    {"save-image", bind("save-image", [](std::string path, const lref& root) {
+      save_image(path, root);
+    })},
+    {"load-image", bind("load-image", load_image)},
+    {"image-up-to-date?", bind("image-up-to-date?", image_up_to_date)},
+    {"open-reader", bind("open-reader", [](std::optional<std::string> path) -> lref {
+      // No path means stdin
+      if (!path) {
+        return std::make_shared<ReaderObject>(std::make_unique<Reader>(0, "<stdin>", false));
+      }
+      return std::make_shared<ReaderObject>(open_reader(*path));
+    })},
+    {"read-next", new LispFunction([](lref args) -> lref {
+      check_num_args(args, 1);
+      auto form = read_next(*reader_arg(car(args))->reader);
+      return form != nullptr ? form : Nil;
+    })},
+    {"reader-done?", new LispFunction([](lref args) -> lref {
+      check_num_args(args, 1);
+      return reader_arg(car(args))->reader->done() ? True : False;
+    })},
+    {"eval-file", eval_file},
+    {"import-file", import_file},
+    {"import-all", import_all},
+    {"read-files", read_files},
+    {"eval-isolated", eval_isolated},
+    {"import-cache-stats", new LispFunction([](lref args) -> lref {
+      check_num_args(args, 0);
+      auto ret = std::make_shared<Map>();
+      ret->set(std::make_shared<Symbol>("hits"), make_int(import_cache_stats.hits));
+      ret->set(std::make_shared<Symbol>("misses"), make_int(import_cache_stats.misses));
+      ret->set(std::make_shared<Symbol>("failed-stores"),
+               make_int(import_cache_stats.failed_stores));
+      return ret;
+    })},
+    {"clear-import-cache", bind("clear-import-cache", [](std::optional<std::string> dir) {
+      // Defaults to the current directory
+      return clear_import_cache(dir.value_or("."));
+    })},
+    {"serialize", bind("serialize", serialize)},
+    {"deserialize", bind("deserialize", deserialize)},
+    {"compile-file", bind_with_callstack("compile-file", [](const lref& callstack,
+                                                             const std::string& source) {
+      return compile_file(source, callstack);
+    })},
+    {"import-image", _import_image},
+    {"assemble-registers", bind("assemble-registers",
+                                [](int nparams, int nlocals, int nregs, const lref& code) -> lref {
+      return assemble_registers(nparams, nlocals, nregs, code);
+    })},
+    {"run-register-bytecode", new LispFunction([](lref args) {
+      if (args == Nil) {
+        throw eval_error("run-register-bytecode requires the code to run.");
+      }
+      return run_register_bytecode(car(args), cdr(args));
+    })},
+    // No strings involved, see gensym() in types.h
+    {"gensym", bind("gensym", []() { return gensym(); })},
+    {"make-generic", bind("make-generic", [](const lref& name) -> lref {
+      return std::make_shared<GenericFunction>(name->repr());
+    })},
+    {"add-method!", bind("add-method!", [](const lref& generic, const lref& type,
+                                           const lref& method) {
+      auto as_generic = dynamic_cast<GenericFunction*>(generic.get());
+      if (as_generic == nullptr) {
+        throw eval_error("Not a generic function: " + try_repr(generic));
+      }
+      // Symbols and strings both name a type
+      auto as_string = dynamic_cast<String*>(type.get());
+      as_generic->add_method(as_string != nullptr ? std::string(as_string->value) : type->repr(), method);
+      return generic;
+    })},
+    {"clock", bind("clock", []() -> int {
+      // Milliseconds since startup. Ints are 32 bits, so it wraps back around to 0
+      // every 2^31 ms (a bit under 25 days). Fine for timing anything shorter.
+      auto elapsed = std::chrono::steady_clock::now() - startup_time;
+      long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+      return ms % (1LL << 31);
+    })},
     {"is-builtin?", new LispFunction([](lref args) {
       check_num_args(args, 1);
       auto sym = std::dynamic_pointer_cast<Symbol>(car(args));
@@ -597,6 +1162,8 @@ lref repl_env = std::shared_ptr<Map>(new Map({
     })},
     {"input", new LispFunction([](lref args) -> lref {
       check_num_args(args, 0);
+      // Otherwise the prompt might still be sitting in the buffer
+      flush_stdout();
       if (std::cin.eof()) {
         return Nil;
       }
@@ -611,4 +1178,5 @@ lref repl_env = std::shared_ptr<Map>(new Map({
     })},
   }));
 
-lref current_env = cons(repl_env, Nil);
+thread_local lref repl_env;
+thread_local lref current_env;
@@ -3,10 +3,25 @@
 
 #include "types.h"
 
-extern lref repl_env;
-extern lref current_env;
-extern LispFunction *plus, *minus;
+// Every builtin, as the map that gets copied into each Interpreter
+extern const lref builtin_table;
+// The current interpreter's copy of builtin_table and its env, see interpreter.h
+extern thread_local lref repl_env;
+extern thread_local lref current_env;
+extern LispFunction *plus, *minus, *mult, *int_divide, *modulo, *lt, *gt, *equals;
+
+/*
+  Expands source a form at a time and saves the expanded forms next to it as a
+  .gelc (see ImageFileWriter), which import loads instead of the source while it's
+  up to date. Each form gets evaled once it's expanded, since later ones can use
+  macros it defines, so compiling a file runs it. Returns the image's path.
+
+  The image only has the expansions the macros gave when it was made. If they
+  change, compile it again.
+*/
+std::string compile_file(const std::string& source, const lref& callstack);
 
 void check_num_args(const lref& arglist, int size);
+void check_num_args(ArgSpan args, int size);
 
 #endif
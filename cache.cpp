@@ -0,0 +1,198 @@
+#include <filesystem>
+#include <fstream>
+
+#include "builtin.h"
+#include "cache.h"
+#include "evaluator.h"
+#include "image.h"
+
+namespace fs = std::filesystem;
+
+ImportCacheStats import_cache_stats;
+
+static const char* const cache_dir_name = ".gelcache";
+
+// FNV-1a
+static uint64_t hash_bytes(const std::string& data, uint64_t h = 14695981039346656037ull) {
+  for (unsigned char c : data) {
+    h = (h ^ c) * 1099511628211ull;
+  }
+  return h;
+}
+
+// Macro bodies have gensyms in them if they used a macro that makes some, and the
+// numbers depend on what's been expanded so far. Leave them out so the key
+// doesn't change every time a cached file gets its gensyms renamed.
+static std::string without_gensym_numbers(const std::string& text) {
+  std::string ret;
+  ret.reserve(text.size());
+  for (size_t i = 0; i < text.size(); i++) {
+    ret += text[i];
+    if (text.compare(i, 3, "#:G") == 0) {
+      ret += ":G";
+      i += 2;
+      while (i + 1 < text.size() && isdigit(text[i + 1])) {
+        i++;
+      }
+    }
+  }
+  return ret;
+}
+
+static thread_local std::vector<ImportDeps*> open_deps;
+
+ImportDeps::ImportDeps() {
+  open_deps.push_back(this);
+}
+
+ImportDeps::~ImportDeps() {
+  open_deps.pop_back();
+}
+
+static std::string read_text(const std::string& source) {
+  std::ifstream file(source, std::ios::binary);
+  if (!file.is_open()) {
+    throw lisp_error("File " + source + " does not exist.");
+  }
+  return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+void import_cache_note(const std::string& source) {
+  if (open_deps.empty()) {
+    return;
+  }
+  uint64_t hash = hash_bytes(read_text(source));
+  for (auto deps : open_deps) {
+    deps->files[source] = hash;
+  }
+}
+
+uint64_t import_cache_key(const std::string& source, const lref& env) {
+  uint64_t key = hash_bytes(read_text(source), hash_bytes(std::to_string(GEL_IMAGE_VERSION)));
+
+  // Added up, since maps hand out their entries in whatever order they like
+  uint64_t macros = 0;
+  for (lref frame = env; frame != Nil; frame = cdr(frame)) {
+    auto map = dynamic_cast<Map*>(car(frame).get());
+    if (map == nullptr) {
+      continue;
+    }
+    for (const auto& [name, value] : map->value) {
+      auto fn = dynamic_cast<ILispFunction*>(value.get());
+      if (fn != nullptr && fn->is_macro) {
+        macros += hash_bytes(without_gensym_numbers(name->repr() + " " + value->repr()));
+      }
+    }
+  }
+
+  return key ^ (macros * 1099511628211ull);
+}
+
+// ext is .gelc for the forms and .deps for what they depend on
+static fs::path cache_path(const std::string& source, uint64_t key, const char* const ext) {
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)key);
+  fs::path path(source);
+  return path.parent_path() / cache_dir_name / (path.filename().string() + "-" + hex + ext);
+}
+
+// Hashes are strings since ints in images are only 32 bits
+static std::string hex_hash(uint64_t hash) {
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+  return hex;
+}
+
+static bool deps_unchanged(const fs::path& path) {
+  lref deps;
+  try {
+    deps = load_image(path);
+  } catch (const image_error&) {
+    return false;
+  }
+  for (; dynamic_cast<Cons*>(deps.get()) != nullptr; deps = cdr(deps)) {
+    auto source = try_str(car(car(deps)));
+    std::error_code ec;
+    if (!fs::exists(source, ec)
+        || try_str(cadr(car(deps))) != hex_hash(hash_bytes(read_text(source)))) {
+      return false;
+    }
+  }
+  return deps == Nil;
+}
+
+std::unique_ptr<ImageFileReader> import_cache_load(const std::string& source, uint64_t key) {
+  auto path = cache_path(source, key, ".gelc");
+  std::error_code ec;
+  if (!fs::exists(path, ec) || !deps_unchanged(cache_path(source, key, ".deps"))) {
+    import_cache_stats.misses++;
+    return nullptr;
+  }
+
+  std::unique_ptr<ImageFileReader> forms;
+  try {
+    forms = std::make_unique<ImageFileReader>(path);
+  } catch (const image_error&) {
+    import_cache_stats.misses++;
+    return nullptr;
+  }
+
+  import_cache_stats.hits++;
+  return forms;
+}
+
+std::unique_ptr<ImageFileWriter> import_cache_writer(const std::string& source, uint64_t key) {
+  auto path = cache_path(source, key, ".gelc");
+  std::error_code ec;
+  fs::create_directories(path.parent_path(), ec);
+  try {
+    return std::make_unique<ImageFileWriter>(path);
+  } catch (const image_error&) {
+    import_cache_stats.failed_stores++;
+    return nullptr;
+  }
+}
+
+void import_cache_commit(const std::string& source, uint64_t key, ImageFileWriter& entry,
+                         const ImportDeps& deps) {
+  auto path = cache_path(source, key, ".gelc");
+  std::error_code ec;
+
+  // Old entries for this file are never going to be used again. Both extensions
+  // are five chars.
+  auto prefix = fs::path(source).filename().string() + "-";
+  for (const auto& dir_entry : fs::directory_iterator(path.parent_path(), ec)) {
+    auto name = dir_entry.path().filename().string();
+    if (name.rfind(prefix, 0) == 0 && name.size() == prefix.size() + 16 + 5) {
+      fs::remove(dir_entry.path(), ec);
+    }
+  }
+
+  lref files = Nil;
+  for (const auto& [file, hash] : deps.files) {
+    files = cons(cons(std::make_shared<String>(file),
+                      cons(std::make_shared<String>(hex_hash(hash)), Nil)),
+                 files);
+  }
+
+  // The deps go first, so there's never an entry without them
+  try {
+    save_image(cache_path(source, key, ".deps"), files);
+    entry.commit();
+  } catch (const image_error&) {
+    import_cache_stats.failed_stores++;
+  }
+}
+
+int clear_import_cache(const std::string& dir) {
+  auto path = fs::path(dir) / cache_dir_name;
+  std::error_code ec;
+  int count = 0;
+  for (const auto& entry : fs::directory_iterator(path, ec)) {
+    if (entry.path().extension() == ".gelc") {
+      count++;
+    }
+  }
+  fs::remove_all(path, ec);
+  return count;
+}
@@ -0,0 +1,76 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+
+#include "image.h"
+#include "types.h"
+
+/*
+  On-disk cache of macroexpanded files for import.
+
+  Expanding a file is the slow part of importing it, so once a file has been
+  imported its expanded top level forms get saved as an image file (see
+  ImageFileWriter) in a .gelcache directory next to it, a form at a time as they
+  get expanded. Next time the same file gets imported with the same macros
+  defined, the forms get loaded and run without expanding anything.
+
+  The key is a hash of the file's contents and of every macro that's defined
+  when the import starts, so editing the file or redefining a macro it might use
+  makes a new entry. Macros the file gets from its own imports aren't defined yet
+  when it starts, so each entry also has a .deps file listing every file imported
+  while it was being made, nested or not, with a hash of each. If any of those
+  has changed the entry doesn't count. clear_import_cache throws the whole
+  directory away.
+
+  Gensyms in a cached file get renamed to fresh ones when it's loaded (images
+  always do that), so they can't collide with ones made since.
+*/
+// For the whole process, since every interpreter shares the cache
+struct ImportCacheStats {
+  std::atomic<unsigned long> hits{0};
+  std::atomic<unsigned long> misses{0};
+  // Files that couldn't be saved, because they expanded to something like a
+  // function object or because the directory isn't writable
+  std::atomic<unsigned long> failed_stores{0};
+};
+extern ImportCacheStats import_cache_stats;
+
+/*
+  The files imported while one's open, for its .deps. Open one around importing
+  a file, and import_cache_note everything that gets imported. Files get added to
+  every ImportDeps open on the thread, so nested imports count for all the files
+  they're nested in.
+*/
+class ImportDeps {
+  public:
+    ImportDeps();
+    ImportDeps(const ImportDeps&) = delete;
+    ImportDeps& operator=(const ImportDeps&) = delete;
+    ~ImportDeps();
+    // Path and hash of the contents
+    std::unordered_map<std::string, uint64_t> files;
+};
+void import_cache_note(const std::string& source);
+
+uint64_t import_cache_key(const std::string& source, const lref& env);
+// The expanded forms, or nullptr if there's no entry or something it depends on
+// has changed
+std::unique_ptr<ImageFileReader> import_cache_load(const std::string& source, uint64_t key);
+// Somewhere to put the expanded forms as they come, or nullptr if the directory
+// can't be written to. Nothing's saved until import_cache_commit.
+std::unique_ptr<ImageFileWriter> import_cache_writer(const std::string& source, uint64_t key);
+void import_cache_commit(const std::string& source, uint64_t key, ImageFileWriter& entry,
+                         const ImportDeps& deps);
+// Deletes the cache next to files in dir. Returns how many entries there were.
+//
+// The key only covers macros themselves, not the functions they call while
+// expanding. So after redefining a function some macro uses (say a helper that
+// builds its output), files expanded with the old one still hit their old
+// entries, and this has to be called by hand.
+int clear_import_cache(const std::string& dir);
+
+#endif
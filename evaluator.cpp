@@ -1,16 +1,98 @@
+#include <atomic>
+
 #include "evaluator.h"
+#include "budget.h"
 #include "builtin.h"
+#include "port.h"
 #include "reader.h"
+#include "vm.h"
 
-static bool Gel_in_debugger = false;
-static std::string Gel_debugger_last_command = "";
+thread_local bool Gel_in_debugger = false;
+thread_local std::string Gel_debugger_last_command = "";
+thread_local bool Gel_in_parallel = false;
+
+static void check_not_parallel(const char* const what) {
+  if (Gel_in_parallel) {
+    throw eval_error(std::string("Can't ") + what + " inside pmap or preduce.");
+  }
+}
 
 void env_set(const lref& env, const lref& key, const lref& value) {
   map_set(car(env), key, value);
 }
 
+// Epochs come from one counter for the whole process, so a cache filled in by one
+// interpreter never looks valid in another
+static std::atomic<unsigned long> epoch_counter{1};
+
+unsigned long new_epoch() {
+  return ++epoch_counter;
+}
+
+thread_local unsigned long global_epoch = 1;
+
 void global_env_set(const lref& key, const lref& value) {
+  check_not_parallel("define globals");
   env_set(current_env, key, value);
+  global_epoch = new_epoch();
+}
+
+thread_local unsigned long generic_epoch = 1;
+
+GenericFunction::GenericFunction(const std::string& name)
+  : LispFunction([this](ArgSpan args) -> lref {
+      if (args.size == 0) {
+        throw eval_error("Generic function " + this->name + " needs at least one argument.");
+      }
+
+      const auto& method = dispatch(args[0]);
+      if (auto fn_return = dynamic_cast<FnReturn*>(method.get())) {
+        lref arglist = Nil;
+        for (size_t i = args.size; i-- > 0;) {
+          arglist = cons(args[i], arglist);
+        }
+        return apply(method, arglist, fn_return->env, Nil);
+      }
+      return call_builtin(method, args.data, args.size);
+    }) {
+  this->name = name;
+}
+
+void GenericFunction::add_method(const std::string& type, const lref& method) {
+  check_not_parallel("add methods");
+  methods[type] = method;
+  generic_epoch = new_epoch();
+}
+
+const lref& GenericFunction::dispatch(const lref& instance) {
+  const auto& type = dispatch_type(instance);
+  if (cached_epoch == generic_epoch && cached_type == &type) {
+    return cached_method;
+  }
+
+  auto type_name = instance == Nil ? "nil-type" : instance->type_string();
+  auto it = methods.find(type_name);
+  if (it == methods.end()) {
+    throw eval_error("No method " + name + " for " + type_name + ": " + try_repr(instance));
+  }
+  // Other threads could be reading the cache
+  if (Gel_in_parallel) {
+    return it->second;
+  }
+
+  cached_type = &type;
+  cached_method = it->second;
+  cached_epoch = generic_epoch;
+  return cached_method;
+}
+
+bool is_global_env(const lref& env) {
+  for (auto cursor = current_env; cursor != Nil; cursor = cdr(cursor)) {
+    if (car(cursor) == env) {
+      return true;
+    }
+  }
+  return false;
 }
 
 lref env_find(const lref& key, const lref& env_cons) {
@@ -59,44 +141,109 @@ lref eval_ast(const lref& env, const lref& ast, const lref& callstack) {
   return ast;
 }
 
-// see https://github.com/kanaka/mal/blob/master/process/guide.md#step7
-lref quasiquote(const lref& ast) {
-  auto as_cons = std::dynamic_pointer_cast<Cons>(ast).get();
+bool is_cons(const lref& obj);
+
+static bool head_is(const lref& form, const char* const name) {
+  auto as_cons = dynamic_cast<Cons*>(form.get());
   if (as_cons == nullptr) {
-    return cons(std::make_shared<Symbol>("quote"), cons(ast, Nil));
+    return false;
   }
+  auto sym = dynamic_cast<Symbol*>(as_cons->car.get());
+  return sym != nullptr && sym->name == name;
+}
 
-  auto car_as_sym = std::dynamic_pointer_cast<Symbol>(as_cons->car).get();
-  if (car_as_sym != nullptr && car_as_sym->name == "unquote") {
-    return car(as_cons->cdr);
-  }
-
-  auto res = Nil;
-
-  // fuck
-  for (auto econs = reversed(ast); econs != Nil; econs = cdr(econs)) {
-    auto elt = car(econs);
-
-    auto elt_as_cons = std::dynamic_pointer_cast<Cons>(elt).get();
-    if (elt_as_cons != nullptr) {
-      auto elt_car_as_sym = std::dynamic_pointer_cast<Symbol>(elt_as_cons->car).get();
-      if (elt_car_as_sym != nullptr && elt_car_as_sym->name == "splice-unquote") {
-        // So _that_ was why I wrote "fuck" here
-        // fuck
-        res = cons(std::make_shared<Symbol>("concat"),
-                   cons(car(elt_as_cons->cdr),
-                        cons(res, Nil)));
-      } else {
-        res = cons(std::make_shared<Symbol>("cons"),
-                   cons(quasiquote(elt),
-                        cons(res, Nil)));
-      }
-    } else {
-      //fuck
-      res = cons(std::make_shared<Symbol>("cons"),
-                  cons(quasiquote(elt),
-                      cons(res, Nil)));
+static lref quoted(const lref& form) {
+  return cons(std::make_shared<Symbol>("quote"), cons(form, Nil));
+}
+
+// The code quasiquote makes calls builtins as the function objects themselves,
+// not by name, so that it still works where something like list is a local
+static lref builtin(const char* const name) {
+  return std::static_pointer_cast<Map>(builtin_table)->get(std::make_shared<Symbol>(name));
+}
+
+// Whether there's an unquote or splice-unquote anywhere in form. Has to look at
+// the source, since ,1 lowers to 1, which looks just as constant as 1 does.
+static bool has_unquote(const lref& form) {
+  if (!is_cons(form)) {
+    return false;
+  }
+  if (head_is(form, "unquote") || head_is(form, "splice-unquote")) {
+    return true;
+  }
+  return has_unquote(car(form)) || has_unquote(cdr(form));
+}
+
+/*
+  Turns the body of a quasiquote into code that builds it. The list is built
+  from the back:
+    - whatever's after the last unquote stays quoted and gets shared instead of
+      rebuilt, so `(a ,b c d) is (list* 'a b '(c d)). That means every list it
+      builds ends in the same (c d), so changing it with rplacd! or append!
+      changes it for all of them, same as changing a quoted list would.
+    - runs of elements get consed on with list*
+    - a splice gets copied onto what comes after it with append. A splice at the
+      very end is used as it is, like in CL, so `(progn ,@body) doesn't copy body.
+  Anything with no unquotes in it at all is just quoted. list*, list and append
+  go in as the builtins themselves, see builtin above.
+
+  This runs once per quasiquote when the code gets macroexpanded, not every time
+  it's evaluated.
+*/
+lref quasiquote(const lref& ast) {
+  if (!is_cons(ast)) {
+    return dynamic_cast<Symbol*>(ast.get()) != nullptr ? quoted(ast) : ast;
+  }
+
+  if (head_is(ast, "unquote")) {
+    return cadr(ast);
+  }
+
+  std::vector<lref> elements;
+  std::vector<lref> lowered;
+  for (auto cursor = ast; cursor != Nil; cursor = cdr(cursor)) {
+    auto elt = car(cursor);
+    elements.push_back(elt);
+    lowered.push_back(head_is(elt, "splice-unquote") ? nullptr : quasiquote(elt));
+  }
+
+  // Find the constant part at the end
+  size_t end = elements.size();
+  lref constant_tail = ast;
+  while (end > 0 && !has_unquote(elements[end - 1])) {
+    end--;
+  }
+  if (end == 0) {
+    return quoted(ast);
+  }
+  for (size_t i = 0; i < end; i++) {
+    constant_tail = cdr(constant_tail);
+  }
+
+  static const lref append = builtin("append");
+  static const lref list = builtin("list");
+  static const lref list_star = builtin("list*");
+
+  // nullptr means there's nothing after this yet
+  lref res = constant_tail != Nil ? quoted(constant_tail) : nullptr;
+  for (size_t i = end; i > 0;) {
+    if (lowered[i - 1] == nullptr) {
+      auto spliced = cadr(elements[i - 1]);
+      res = res == nullptr ? spliced : cons(append, cons(spliced, cons(res, Nil)));
+      i--;
+      continue;
     }
+
+    size_t start = i;
+    while (start > 0 && lowered[start - 1] != nullptr) {
+      start--;
+    }
+    lref args = res == nullptr ? Nil : cons(res, Nil);
+    for (size_t j = i; j > start; j--) {
+      args = cons(lowered[j - 1], args);
+    }
+    res = cons(res == nullptr ? list : list_star, args);
+    i = start;
   }
 
   return res;
@@ -191,16 +338,14 @@ lref macroexpand(lref ast, const lref& env, const lref& callstack) {
 }
 
 void print_callstack(const lref& callstack) {
+  flush_stdout();
   for (lref cursor = callstack; cursor != Nil; cursor = cdr(cursor)) {
     auto rep = car(cursor)->repr();
     if (rep.size() > 96) {
       rep = rep.substr(0, 96) + "...";
     }
 
-    const auto& linum = line_table[(unsigned long)car(cursor).get()];
-    std::cout << linum.filename
-              << ":" << linum.line
-              << " " << rep << std::endl;
+    std::cout << source_location(car(cursor)) << " " << rep << std::endl;
   }
 }
 
@@ -208,13 +353,20 @@ lref eval(lref env, lref input, const lref& old_callstack) {
   auto new_callstack = cons(input, old_callstack);
 
   while (true) {
+    if (!fuel_tick()) {
+      out_of_budget();
+    }
+
     if (input.get() == nullptr) {
       // If there's nothing left to evaluate, quit
+      flush_stdout();
       std::cout << "bye" << std::endl;
       exit(0);
     }
 
     if (Gel_in_debugger) {
+      // The debugger talks through std::cout
+      flush_stdout();
       if (std::cin.eof()) {
         std::cout << "bye" << std::endl;
         exit(0);
@@ -244,10 +396,13 @@ lref eval(lref env, lref input, const lref& old_callstack) {
       if (inp != "s") {
         try {
           Gel_in_debugger = false;
-          std::cout << eval(env, read(inp.c_str()), new_callstack)->repr() << std::endl;
+          auto value = eval(env, read(inp.c_str()), new_callstack);
+          flush_stdout();
+          std::cout << value->repr() << std::endl;
           Gel_in_debugger = true;
         } catch (const lisp_error& e) {
           auto val = e.value.get();
+          flush_stdout();
           if (val == nullptr) {
               std::cout << "Unknown error. Value of lisp_error was Nil."
                           << " This should never happen."
@@ -290,9 +445,8 @@ lref eval(lref env, lref input, const lref& old_callstack) {
     if (special_symbol != nullptr) {
       if (special_symbol->name == "break") {
         Gel_in_debugger = true;
-        const auto& linum = line_table[(unsigned long)car(old_callstack).get()];
-        std::cout << linum.filename
-                  << ":" << linum.line
+        flush_stdout();
+        std::cout << source_location(car(old_callstack))
                   << " " << car(old_callstack)->repr() << std::endl;
         input = Nil;
         continue;
@@ -309,7 +463,13 @@ lref eval(lref env, lref input, const lref& old_callstack) {
           throw eval_error("Symbol " + try_repr(car(args)) + " not found.");
         }
 
-        map_set(l_env, car(args), eval(env, cadr(args), new_callstack));
+        if (is_global_env(l_env)) {
+          check_not_parallel("set globals");
+          map_set(l_env, car(args), eval(env, cadr(args), new_callstack));
+          global_epoch = new_epoch();
+        } else {
+          map_set(l_env, car(args), eval(env, cadr(args), new_callstack));
+        }
         input = cadr(args);
         continue;
       }
@@ -419,16 +579,44 @@ lref macroexpand_recursive(lref env, lref input) {
   if (!is_cons(input)) return input;
 
   input = macroexpand(input, env, Nil);
+  // Macros can expand to atoms
+  if (!is_cons(input)) return input;
+
+  // Quoted stuff is data, and quasiquotes get turned into code that builds the list
+  if (head_is(input, "quote")) return input;
+  if (head_is(input, "quasiquote")) {
+    check_num_args(cdr(input), 1);
+    return macroexpand_recursive(env, quasiquote(cadr(input)));
+  }
+
+  // Expansions can share structure with quoted lists in macros (see quasiquote), so
+  // this copies the cells in front of anything that changed instead of writing to
+  // them. Stuff that doesn't change doesn't get copied.
+  std::vector<lref> cells;
+  std::vector<lref> expanded;
+  size_t last_changed = 0;
   for (auto c = input; c != Nil; c = cdr(c)) {
-    auto _c = std::dynamic_pointer_cast<Cons>(c);
+    auto _c = dynamic_cast<Cons*>(c.get());
     if (_c == nullptr) throw eval_error("Can't macroexpand something that's not a cons.");
-    _c->car = macroexpand_recursive(env, _c->car);
+    cells.push_back(c);
+    expanded.push_back(macroexpand_recursive(env, _c->car));
+    if (expanded.back() != _c->car) {
+      last_changed = cells.size();
+    }
   }
 
-  return input;
+  lref ret = last_changed < cells.size() ? cells[last_changed] : Nil;
+  for (size_t i = last_changed; i > 0; i--) {
+    auto old_cell = static_cast<Cons*>(cells[i - 1].get());
+    ret = cons(expanded[i - 1], ret);
+    // Keep the source location for the debugger
+    auto new_cell = static_cast<Cons*>(ret.get());
+    new_cell->file = old_cell->file;
+    new_cell->line = old_cell->line;
+  }
+  return ret;
 }
 
 lref eval_toplevel(lref env, lref input) {
-  macroexpand_recursive(env, input);
-  return eval(env, input, Nil);
+  return eval(env, macroexpand_recursive(env, input), Nil);
 }
@@ -1,6 +1,8 @@
 #ifndef EVALUATOR_H
 #define EVALUATOR_H
 
+#include <typeinfo>
+
 #include "types.h"
 
 class eval_error : public lisp_error { using lisp_error::lisp_error; };
@@ -11,6 +13,11 @@ lref eval(lref env, lref input, const lref& callstack);
 lref apply(const lref& func, const lref& args, lref env, const lref& callstack);
 
 void global_env_set(const lref& key, const lref& value);
+// Goes up every time a global gets (re)defined or set, so anything caching globals
+// knows to look them up again
+extern thread_local unsigned long global_epoch;
+// A value for an epoch that no interpreter has used yet
+unsigned long new_epoch();
 lref env_get(const lref& env, const lref& key);
 
 // Structure that allows doing TCO with lref functions
@@ -29,4 +36,42 @@ struct FnReturn : ILispFunction {
   std::string type_string() const { return "function"; }
 };
 
+/*
+  A function that picks what to run by the type of its first arg. Methods are
+  keyed by the name type gives for the things they take. dispatch goes through a
+  one entry cache keyed by the instance's C++ class, so calling it on the same
+  kind of thing over and over never touches the table. CALL_GLOBAL sites in the
+  VM keep a cache like that of their own (see vm.cpp).
+*/
+struct GenericFunction : LispFunction {
+  std::unordered_map<std::string, lref> methods;
+
+  GenericFunction(const std::string& name);
+  std::string repr() const { return "<generic " + name + ">"; }
+  std::string type_string() const { return "generic-function"; }
+
+  void add_method(const std::string& type, const lref& method);
+  const lref& dispatch(const lref& instance);
+
+  private:
+    const std::type_info* cached_type = nullptr;
+    lref cached_method;
+    unsigned long cached_epoch = 0;
+};
+
+// What dispatch keys its cache on. Nil is a plain LispObject, so it gets its own.
+inline const std::type_info& dispatch_type(const lref& instance) {
+  return instance == Nil ? typeid(void) : typeid(*instance);
+}
+// Goes up every time any generic function gets a method, so every cache of a
+// dispatch knows to look again
+extern thread_local unsigned long generic_epoch;
+
+extern thread_local bool Gel_in_debugger;
+// Set on every thread helping with a pmap or preduce. They all share one
+// interpreter's env, so while it's set nothing can change a global, and caches
+// that more than one thread can see only get filled in under a lock.
+extern thread_local bool Gel_in_parallel;
+extern thread_local std::string Gel_debugger_last_command;
+
 #endif
@@ -0,0 +1,529 @@
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <unordered_set>
+
+#include "builtin.h"
+#include "image.h"
+#include "reader.h"
+#include "vm.h"
+
+namespace fs = std::filesystem;
+
+static const char image_magic[4] = {'G', 'E', 'L', 'C'};
+
+struct ImageWriter {
+  std::vector<std::string> strings;
+  std::unordered_map<std::string, uint32_t> string_index;
+  std::vector<ImageRecord> records;
+  std::vector<ImageLine> lines;
+  std::unordered_map<const LispObject*, uint32_t> seen;
+  // Conses and maps that are still being saved. Running into one of them again
+  // means it contains itself, and there's no way to write that out. Only ones
+  // with more than one reference go in, since getting back to something means
+  // there's a second way to it.
+  std::unordered_set<const LispObject*> walking;
+  // Builtins are saved by name
+  std::unordered_map<const LispObject*, std::string> builtin_names;
+
+  ImageWriter() {
+    for (const auto& [key, value] : std::static_pointer_cast<Map>(repl_env)->value) {
+      builtin_names[value.get()] = key->repr();
+    }
+  }
+
+  uint32_t add_string(const std::string& s) {
+    auto it = string_index.find(s);
+    if (it != string_index.end()) {
+      return it->second;
+    }
+    strings.push_back(s);
+    return string_index[s] = strings.size() - 1;
+  }
+
+  uint32_t add_record(const LispObject* obj, ImageTag tag, uint32_t a = 0, uint32_t b = 0,
+                      uint32_t c = 0) {
+    records.push_back({tag, a, b, c});
+    uint32_t idx = records.size() - 1;
+    if (obj != nullptr) {
+      seen[obj] = idx;
+    }
+    return idx;
+  }
+
+  // obj has to be the actual field the object is stored in, not a copy, so that
+  // use_count says whether anything else points at it. Only things that are
+  // pointed at more than once need to go through seen.
+  uint32_t add(const lref& obj) {
+    if (obj == nullptr) {
+      throw image_error("Can't save a null reference.");
+    }
+
+    bool shared = obj.use_count() > 1;
+    if (shared) {
+      auto it = seen.find(obj.get());
+      if (it != seen.end()) {
+        return it->second;
+      }
+    }
+    auto self = shared ? obj.get() : nullptr;
+
+    if (obj == Nil) return add_record(self, ImageTag::NIL);
+    if (obj == True) return add_record(self, ImageTag::TRUE);
+    if (obj == False) return add_record(self, ImageTag::FALSE);
+
+    if (auto i = dynamic_cast<LispInt*>(obj.get())) {
+      return add_record(self, ImageTag::INT, (uint32_t)i->val);
+    }
+    if (auto sym = dynamic_cast<Symbol*>(obj.get())) {
+      return add_record(self, ImageTag::SYMBOL, add_string(sym->name));
+    }
+    if (auto str = dynamic_cast<String*>(obj.get())) {
+      return add_record(self, ImageTag::STRING, add_string(std::string(str->value)));
+    }
+    if (dynamic_cast<Cons*>(obj.get())) {
+      return add_list(obj);
+    }
+    if (auto map = dynamic_cast<Map*>(obj.get())) {
+      enter(obj);
+      std::vector<std::pair<uint32_t, uint32_t>> entries;
+      for (const auto& [key, value] : map->value) {
+        // Map::get leaves a null behind for keys that weren't there
+        if (value != nullptr) {
+          entries.push_back({add(key), add(value)});
+        }
+      }
+      leave(obj);
+      uint32_t first = records.size();
+      for (const auto& [key, value] : entries) {
+        add_record(nullptr, ImageTag::ENTRY, key, value);
+      }
+      return add_record(self, ImageTag::MAP, first, entries.size());
+    }
+    if (auto code = dynamic_cast<Bytecode*>(obj.get())) {
+      std::vector<uint32_t> operands;
+      for (const auto& instruction : code->code) {
+        operands.push_back(add(instruction.operand));
+      }
+      uint32_t first = records.size();
+      for (size_t i = 0; i < code->code.size(); i++) {
+        add_record(nullptr, ImageTag::INSTR, (uint32_t)code->code[i].code, operands[i],
+                   (uint32_t)code->code[i].n);
+      }
+      for (const auto& handler : code->handlers) {
+        add_record(nullptr, ImageTag::HANDLER, handler.start, handler.end, handler.target);
+      }
+      return add_record(self, ImageTag::BYTECODE, first, code->code.size(),
+                        code->handlers.size());
+    }
+
+    auto name = builtin_names.find(obj.get());
+    if (name != builtin_names.end()) {
+      return add_record(self, ImageTag::BUILTIN, add_string(name->second));
+    }
+
+    throw image_error("Can't save a " + obj->type_string() + ": " + try_repr(obj));
+  }
+
+  void enter(const lref& obj) {
+    if (obj.use_count() > 1 && !walking.insert(obj.get()).second) {
+      throw image_error("Can't save a cyclic structure");
+    }
+  }
+
+  void leave(const lref& obj) {
+    if (obj.use_count() > 1) {
+      walking.erase(obj.get());
+    }
+  }
+
+  // Walks down the cdrs with a loop, so long lists don't blow the C++ stack
+  uint32_t add_list(const lref& list) {
+    // Pointers to the cdr fields themselves, so add can still see their use counts
+    std::vector<const lref*> cells;
+    const lref* cursor = &list;
+    while (dynamic_cast<Cons*>(cursor->get())
+           && (cursor->use_count() == 1 || seen.find(cursor->get()) == seen.end())) {
+      enter(*cursor);
+      cells.push_back(cursor);
+      cursor = &static_cast<Cons*>(cursor->get())->cdr;
+    }
+
+    uint32_t tail = add(*cursor);
+    for (auto it = cells.rbegin(); it != cells.rend(); it++) {
+      auto cell = static_cast<Cons*>((*it)->get());
+      uint32_t car = add(cell->car);
+      tail = add_record((*it)->use_count() > 1 ? cell : nullptr, ImageTag::CONS, car, tail);
+      leave(**it);
+
+      if (cell->file != 0) {
+        lines.push_back({tail, add_string(file_name(cell->file)), cell->line});
+      }
+    }
+    return tail;
+  }
+
+  void write(std::ostream& out, uint32_t root) {
+    std::vector<uint32_t> table;
+    std::string data;
+    for (const auto& s : strings) {
+      table.push_back(data.size());
+      table.push_back(s.size());
+      data += s;
+    }
+    while (data.size() % 4 != 0) {
+      data += '\0';
+    }
+
+    ImageHeader header;
+    std::memcpy(header.magic, image_magic, 4);
+    header.version = GEL_IMAGE_VERSION;
+    header.nstrings = strings.size();
+    header.string_bytes = data.size();
+    header.nrecords = records.size();
+    header.nlines = lines.size();
+    header.root = root;
+
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)table.data(), table.size() * sizeof(uint32_t));
+    out.write(data.data(), data.size());
+    out.write((const char*)records.data(), records.size() * sizeof(ImageRecord));
+    out.write((const char*)lines.data(), lines.size() * sizeof(ImageLine));
+  }
+};
+
+// Images get written to a temp file and renamed over the old one, so nobody ever
+// sees half an image. Named per thread since two interpreters could be saving the
+// same one.
+static std::string tmp_path(const std::string& path) {
+  std::ostringstream tmp_name;
+  tmp_name << path << "." << std::this_thread::get_id() << ".tmp";
+  return tmp_name.str();
+}
+
+void save_image(const std::string& path, const lref& root) {
+  ImageWriter writer;
+  uint32_t idx = writer.add(root);
+
+  auto tmp = tmp_path(path);
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) {
+      throw image_error("Can't write " + path);
+    }
+    writer.write(out, idx);
+    if (!out.good()) {
+      throw image_error("Can't write " + path);
+    }
+  }
+  std::error_code ec;
+  fs::rename(tmp, path, ec);
+  if (ec) {
+    throw image_error("Can't write " + path + ": " + ec.message());
+  }
+}
+
+std::string serialize(const lref& root) {
+  ImageWriter writer;
+  uint32_t idx = writer.add(root);
+  std::ostringstream out;
+  writer.write(out, idx);
+  return out.str();
+}
+
+// The size of the whole image a header's for
+static size_t image_size(const ImageHeader& header) {
+  return sizeof(ImageHeader) + (size_t)header.nstrings * 2 * sizeof(uint32_t)
+    + header.string_bytes + (size_t)header.nrecords * sizeof(ImageRecord)
+    + (size_t)header.nlines * sizeof(ImageLine);
+}
+
+// what is only for error messages. If there's a gensyms map, gensyms get renamed
+// through it, so they come out the same as in other images loaded with it.
+static lref load_bytes(const uint8_t* bytes, size_t size, const std::string& what,
+                       std::unordered_map<std::string, lref>* gensyms = nullptr) {
+  auto bad = [&](const std::string& msg) {
+    return image_error("Bad image " + what + ": " + msg);
+  };
+
+  if (size < sizeof(ImageHeader)) {
+    throw bad("too short");
+  }
+  auto header = reinterpret_cast<const ImageHeader*>(bytes);
+  if (std::memcmp(header->magic, image_magic, 4) != 0) {
+    throw bad("not an image");
+  }
+  if (header->version != GEL_IMAGE_VERSION) {
+    throw bad("version " + std::to_string(header->version) + ", expected "
+              + std::to_string(GEL_IMAGE_VERSION));
+  }
+
+  // Everything's 4 byte aligned, so the sections can be used right where they are
+  size_t table_at = sizeof(ImageHeader);
+  size_t data_at = table_at + (size_t)header->nstrings * 2 * sizeof(uint32_t);
+  size_t records_at = data_at + header->string_bytes;
+  size_t lines_at = records_at + (size_t)header->nrecords * sizeof(ImageRecord);
+  if (image_size(*header) != size || header->root >= header->nrecords) {
+    throw bad("sizes don't add up");
+  }
+
+  auto table = reinterpret_cast<const uint32_t*>(bytes + table_at);
+  auto data = reinterpret_cast<const char*>(bytes + data_at);
+  auto records = reinterpret_cast<const ImageRecord*>(bytes + records_at);
+  auto lines = reinterpret_cast<const ImageLine*>(bytes + lines_at);
+
+  auto string = [&](uint32_t idx) {
+    if (idx >= header->nstrings
+        || (size_t)table[2 * idx] + table[2 * idx + 1] > header->string_bytes) {
+      throw bad("string " + std::to_string(idx) + " out of range");
+    }
+    return std::string(data + table[2 * idx], table[2 * idx + 1]);
+  };
+
+  // One Symbol per name, however many times it shows up
+  std::vector<lref> symbols(header->nstrings);
+  std::vector<lref> objects(header->nrecords);
+
+  auto ref = [&](uint32_t at, uint32_t idx) -> const lref& {
+    if (idx >= at || objects[idx] == nullptr) {
+      throw bad("record " + std::to_string(at) + " refers forward or to a non-object");
+    }
+    return objects[idx];
+  };
+
+  for (uint32_t i = 0; i < header->nrecords; i++) {
+    const auto& record = records[i];
+    switch (record.tag) {
+      case ImageTag::NIL:
+        objects[i] = Nil;
+        break;
+      case ImageTag::TRUE:
+        objects[i] = True;
+        break;
+      case ImageTag::FALSE:
+        objects[i] = False;
+        break;
+      case ImageTag::INT:
+        objects[i] = make_int((int)record.a);
+        break;
+      case ImageTag::SYMBOL:
+        if (record.a >= header->nstrings) {
+          throw bad("string " + std::to_string(record.a) + " out of range");
+        }
+        if (symbols[record.a] == nullptr) {
+          auto sym = std::make_shared<Symbol>(string(record.a));
+          // Every use of a gensym in the image gets the same new one, see gensym()
+          if (!is_gensym(*sym)) {
+            symbols[record.a] = sym;
+          } else if (gensyms == nullptr) {
+            symbols[record.a] = gensym();
+          } else {
+            auto& renamed = (*gensyms)[sym->name];
+            if (renamed == nullptr) {
+              renamed = gensym();
+            }
+            symbols[record.a] = renamed;
+          }
+        }
+        objects[i] = symbols[record.a];
+        break;
+      case ImageTag::STRING:
+        objects[i] = std::make_shared<String>(string(record.a));
+        break;
+      case ImageTag::CONS:
+        objects[i] = cons(ref(i, record.a), ref(i, record.b));
+        break;
+      case ImageTag::BUILTIN:
+      {
+        auto name = string(record.a);
+        auto fn = map_get(repl_env, std::make_shared<Symbol>(name));
+        if (dynamic_cast<LispFunction*>(fn.get()) == nullptr
+            && dynamic_cast<SecondOrderLispFunction*>(fn.get()) == nullptr) {
+          throw bad("no builtin called " + name);
+        }
+        objects[i] = fn;
+      }
+        break;
+      case ImageTag::INSTR:
+      case ImageTag::HANDLER:
+      case ImageTag::ENTRY:
+        break;
+      case ImageTag::MAP:
+      {
+        if (record.a > i || record.b > i - record.a) {
+          throw bad("map at " + std::to_string(i) + " has entries out of range");
+        }
+        auto map = std::make_shared<Map>();
+        for (uint32_t j = record.a; j < record.a + record.b; j++) {
+          const auto& entry = records[j];
+          if (entry.tag != ImageTag::ENTRY) {
+            throw bad("bad map entry at " + std::to_string(j));
+          }
+          map->set(ref(j, entry.a), ref(j, entry.b));
+        }
+        objects[i] = map;
+      }
+        break;
+      case ImageTag::BYTECODE:
+      {
+        if (record.a > i || (uint64_t)record.b + record.c > i - record.a) {
+          throw bad("bytecode at " + std::to_string(i) + " has instructions out of range");
+        }
+        std::vector<Instruction> code;
+        code.reserve(record.b);
+        for (uint32_t j = record.a; j < record.a + record.b; j++) {
+          const auto& instr = records[j];
+          if (instr.tag != ImageTag::INSTR || instr.a >= (uint32_t)Opcode::NUM_OPCODES) {
+            throw bad("bad instruction at " + std::to_string(j));
+          }
+          code.emplace_back((Opcode)instr.a, ref(j, instr.b), (int)instr.c);
+        }
+        std::vector<Handler> handlers;
+        for (uint32_t j = record.a + record.b; j < record.a + record.b + record.c; j++) {
+          const auto& handler = records[j];
+          if (handler.tag != ImageTag::HANDLER) {
+            throw bad("bad handler at " + std::to_string(j));
+          }
+          handlers.push_back({(int)handler.a, (int)handler.b, (int)handler.c});
+        }
+        // Gets verified the first time it runs, same as anything else
+        objects[i] = std::make_shared<Bytecode>(code, handlers);
+      }
+        break;
+      default:
+        throw bad("unknown tag at " + std::to_string(i));
+    }
+  }
+
+  for (uint32_t i = 0; i < header->nlines; i++) {
+    const auto& line = lines[i];
+    if (line.record >= header->nrecords || objects[line.record] == nullptr) {
+      throw bad("line info for a record that isn't there");
+    }
+    auto cell = dynamic_cast<Cons*>(objects[line.record].get());
+    if (cell == nullptr) {
+      throw bad("line info for something that isn't a cons");
+    }
+    cell->file = intern_file(string(line.file));
+    cell->line = line.line;
+  }
+
+  return objects[header->root];
+}
+
+lref load_image(const std::string& path) {
+  std::string file;
+  try {
+    file = read_whole_file(path);
+  } catch (const lisp_error&) {
+    throw image_error("Can't open " + path);
+  }
+  return load_bytes(reinterpret_cast<const uint8_t*>(file.data()), file.size(), path);
+}
+
+lref deserialize(std::string_view bytes) {
+  // The sections get read in place, so they have to be aligned. A string's own
+  // buffer is, but a substr of one can start anywhere.
+  if (reinterpret_cast<uintptr_t>(bytes.data()) % alignof(uint32_t) != 0) {
+    std::vector<uint32_t> aligned((bytes.size() + sizeof(uint32_t) - 1) / sizeof(uint32_t));
+    std::memcpy(aligned.data(), bytes.data(), bytes.size());
+    return load_bytes(reinterpret_cast<const uint8_t*>(aligned.data()), bytes.size(), "string");
+  }
+  return load_bytes(reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size(), "string");
+}
+
+bool image_up_to_date(const std::string& path, const std::string& source) {
+  std::error_code ec;
+  auto image_time = fs::last_write_time(path, ec);
+  if (ec) {
+    return false;
+  }
+  auto source_time = fs::last_write_time(source, ec);
+  if (ec || image_time < source_time) {
+    return false;
+  }
+
+  // compile-file on a file with no forms in it
+  if (fs::file_size(path, ec) == 0 && !ec) {
+    return true;
+  }
+
+  // Images from another version of gel get rebuilt rather than failing to load
+  std::ifstream in(path, std::ios::binary);
+  ImageHeader header;
+  if (!in.read((char*)&header, sizeof(header))) {
+    return false;
+  }
+  return std::memcmp(header.magic, image_magic, 4) == 0 && header.version == GEL_IMAGE_VERSION;
+}
+
+ImageFileWriter::ImageFileWriter(const std::string& path)
+  : path(path), tmp(tmp_path(path)), out(tmp, std::ios::binary | std::ios::trunc) {
+  if (!out.is_open()) {
+    throw image_error("Can't write " + path);
+  }
+}
+
+ImageFileWriter::~ImageFileWriter() {
+  if (!committed) {
+    out.close();
+    std::error_code ec;
+    fs::remove(tmp, ec);
+  }
+}
+
+void ImageFileWriter::add(const lref& form) {
+  ImageWriter writer;
+  uint32_t idx = writer.add(form);
+  writer.write(out, idx);
+}
+
+void ImageFileWriter::commit() {
+  out.close();
+  if (!out.good()) {
+    throw image_error("Can't write " + path);
+  }
+  std::error_code ec;
+  fs::rename(tmp, path, ec);
+  if (ec) {
+    throw image_error("Can't write " + path + ": " + ec.message());
+  }
+  committed = true;
+}
+
+ImageFileReader::ImageFileReader(const std::string& path)
+  : path(path), in(path, std::ios::binary) {
+  std::error_code ec;
+  left = fs::file_size(path, ec);
+  if (!in.is_open() || ec) {
+    throw image_error("Can't open " + path);
+  }
+}
+
+lref ImageFileReader::next() {
+  if (left == 0) {
+    return nullptr;
+  }
+
+  ImageHeader header;
+  if (left < sizeof(header) || !in.read((char*)&header, sizeof(header))) {
+    throw image_error("Bad image " + path + ": cut off");
+  }
+  // Checked before allocating anything, in case the header's garbage
+  size_t size = image_size(header);
+  if (size > left) {
+    throw image_error("Bad image " + path + ": cut off");
+  }
+
+  // uint32_ts so the sections are aligned
+  buffer.resize((size + sizeof(uint32_t) - 1) / sizeof(uint32_t));
+  auto bytes = reinterpret_cast<char*>(buffer.data());
+  std::memcpy(bytes, &header, sizeof(header));
+  if (!in.read(bytes + sizeof(header), size - sizeof(header))) {
+    throw image_error("Bad image " + path + ": cut off");
+  }
+  left -= size;
+  return load_bytes(reinterpret_cast<const uint8_t*>(bytes), size, path, &gensyms);
+}
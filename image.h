@@ -0,0 +1,118 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <cstdint>
+#include <fstream>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "types.h"
+
+struct image_error : public lisp_error { using lisp_error::lisp_error; };
+
+/*
+  .gelc images: a form (and everything it points to) written out so it can be
+  read in one go and turned back into objects without going through the reader.
+
+  Layout, all little endian u32s:
+    header
+    string table: offset and length of each string in the string data
+    string data, padded to 4 bytes. Symbol names, string contents and filenames all
+      live here, each only once, so every use of a symbol in the file shares one Symbol.
+    records: one per object, children always before parents, so loading is a single
+      pass that only has to turn indices into pointers
+    lines: which lists came from which line, for the debugger
+
+  The same format doubles as the serialization format for plain data (serialize
+  and deserialize just skip the file).
+*/
+const uint32_t GEL_IMAGE_VERSION = 4;
+
+enum class ImageTag : uint32_t {
+  NIL,
+  TRUE,
+  FALSE,
+  INT,       // a = value
+  SYMBOL,    // a = string
+  STRING,    // a = string
+  CONS,      // a = car, b = cdr
+  BUILTIN,   // a = string, the name it has in repl_env
+  INSTR,     // a = opcode, b = operand, c = n. Only ever part of a BYTECODE.
+  BYTECODE,  // a = first INSTR, b = number of instructions, c = number of handlers
+  HANDLER,   // a = start, b = end, c = target. Right after the instructions of a BYTECODE.
+  ENTRY,     // a = key, b = value. Only ever part of a MAP.
+  MAP,       // a = first ENTRY, b = number of entries
+  NUM_TAGS
+};
+
+struct ImageHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t nstrings;
+  uint32_t string_bytes;
+  uint32_t nrecords;
+  uint32_t nlines;
+  uint32_t root;
+};
+
+struct ImageRecord {
+  ImageTag tag;
+  uint32_t a;
+  uint32_t b;
+  uint32_t c;
+};
+
+struct ImageLine {
+  uint32_t record;
+  uint32_t file;
+  uint32_t line;
+};
+
+void save_image(const std::string& path, const lref& root);
+lref load_image(const std::string& path);
+// Same as the above but in memory. The string is the whole image.
+std::string serialize(const lref& root);
+lref deserialize(std::string_view bytes);
+// Whether path is an image this build can load that's at least as new as source
+bool image_up_to_date(const std::string& path, const std::string& source);
+
+/*
+  A whole file's worth of top level forms, as one image per form back to back.
+  compile-file writes them a form at a time as it expands the file, and import
+  reads them back a form at a time, so neither has the whole file in memory.
+
+  Every use of a gensym in the file gets the same new one, not just every use in
+  the same form.
+*/
+class ImageFileWriter {
+  public:
+    // Nothing shows up at path until commit
+    ImageFileWriter(const std::string& path);
+    ImageFileWriter(const ImageFileWriter&) = delete;
+    ImageFileWriter& operator=(const ImageFileWriter&) = delete;
+    // Throws away what's been written if commit wasn't called
+    ~ImageFileWriter();
+    void add(const lref& form);
+    void commit();
+  private:
+    std::string path;
+    std::string tmp;
+    std::ofstream out;
+    bool committed = false;
+};
+
+class ImageFileReader {
+  public:
+    ImageFileReader(const std::string& path);
+    // The next form, or nullptr after the last one
+    lref next();
+  private:
+    std::string path;
+    std::ifstream in;
+    size_t left = 0;
+    std::vector<uint32_t> buffer;
+    std::unordered_map<std::string, lref> gensyms;
+};
+
+#endif
@@ -0,0 +1,138 @@
+#include "interpreter.h"
+#include "builtin.h"
+#include "evaluator.h"
+#include "jit.h"
+#include "port.h"
+#include "reader.h"
+#include "vm.h"
+
+static thread_local Interpreter* current_interpreter = nullptr;
+
+// Trades the thread_locals for what's in state. Doing it again trades them back.
+static void swap_state(InterpreterState& state) {
+  std::swap(repl_env, state.builtins);
+  std::swap(current_env, state.env);
+  std::swap(global_epoch, state.global_epoch);
+  std::swap(generic_epoch, state.generic_epoch);
+  std::swap(Gel_in_debugger, state.in_debugger);
+  std::swap(Gel_debugger_last_command, state.debugger_last_command);
+  std::swap(stdout_port, state.stdout_port);
+  std::swap(current_output, state.output);
+  std::swap(jit_threshold, state.jit_threshold);
+}
+
+Interpreter::Scope::Scope(Interpreter& interpreter)
+  : interpreter(interpreter), previous(current_interpreter),
+    reentered(current_interpreter == &interpreter) {
+  if (reentered) {
+    return;
+  }
+  if (interpreter.running.exchange(true)) {
+    throw lisp_error("Interpreter is already running somewhere else.");
+  }
+  swap_state(interpreter.state);
+  current_interpreter = &interpreter;
+}
+
+Interpreter::Scope::~Scope() {
+  if (reentered) {
+    return;
+  }
+  swap_state(interpreter.state);
+  current_interpreter = previous;
+  interpreter.running = false;
+}
+
+Interpreter::Interpreter() {
+  state.builtins = std::make_shared<Map>(*std::static_pointer_cast<Map>(builtin_table));
+  // Make a new env for user stuff so is-builtin? will work
+  state.env = cons(std::make_shared<Map>(), cons(state.builtins, Nil));
+  state.global_epoch = new_epoch();
+  state.generic_epoch = new_epoch();
+  state.stdout_port = std::make_shared<FilePort>(1, "stdout", false);
+  state.output = state.stdout_port;
+
+  eval("(-def-internal! 'progn (fn (&rest forms) (if (empty? forms) nil (last forms))))");
+  eval("(-def-internal! 'load-file eval-file)");
+}
+
+Interpreter::~Interpreter() {
+  try {
+    state.stdout_port->flush();
+  } catch (const lisp_error&) {
+    // Nowhere to report it from here
+  }
+}
+
+lref Interpreter::eval(std::string_view source) {
+  Scope scope(*this);
+  Reader reader(source, "[embedded]");
+  lref ret = Nil;
+  for (auto form = read_next(reader); form != nullptr; form = read_next(reader)) {
+    ret = eval_toplevel(current_env, form);
+  }
+  return ret;
+}
+
+lref Interpreter::eval(const lref& form) {
+  Scope scope(*this);
+  return eval_toplevel(current_env, form);
+}
+
+lref Interpreter::eval(std::string_view source, const Budget& budget) {
+  Scope scope(*this);
+  BudgetScope budget_scope(budget);
+  return eval(source);
+}
+
+lref Interpreter::eval(const lref& form, const Budget& budget) {
+  Scope scope(*this);
+  BudgetScope budget_scope(budget);
+  return eval(form);
+}
+
+lref Interpreter::resume(Coroutine& coroutine, const Budget& budget, const lref& value) {
+  Scope scope(*this);
+  return resume_with_budget(coroutine, value, budget);
+}
+
+void Interpreter::load_file(const std::string& path) {
+  eval(cons(std::make_shared<Symbol>("load-file"), cons(std::make_shared<String>(path), Nil)));
+}
+
+void Interpreter::load_stdlib() {
+  load_file("init.gel");
+}
+
+lref Interpreter::get(const std::string& name) {
+  Scope scope(*this);
+  return env_get(current_env, std::make_shared<Symbol>(name));
+}
+
+void Interpreter::set(const std::string& name, const lref& value) {
+  Scope scope(*this);
+  global_env_set(std::make_shared<Symbol>(name), value);
+}
+
+InterpreterState share_current_state() {
+  InterpreterState state;
+  state.builtins = repl_env;
+  state.env = current_env;
+  state.global_epoch = global_epoch;
+  state.generic_epoch = generic_epoch;
+  state.stdout_port = stdout_port;
+  state.output = current_output;
+  state.jit_threshold = jit_threshold;
+  return state;
+}
+
+SharedScope::SharedScope(const InterpreterState& shared)
+  : state(shared), was_parallel(Gel_in_parallel) {
+  swap_state(state);
+  Gel_in_parallel = true;
+}
+
+SharedScope::~SharedScope() {
+  swap_state(state);
+  Gel_in_parallel = was_parallel;
+}
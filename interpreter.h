@@ -0,0 +1,128 @@
+#ifndef INTERPRETER_H
+#define INTERPRETER_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "budget.h"
+#include "types.h"
+
+struct Coroutine;
+struct OutputPort;
+
+/*
+  Everything one interpreter needs that used to be global. It lives in
+  thread_locals (current_env, repl_env and so on) while the interpreter is
+  running, so none of the evaluator has to pass it around.
+*/
+struct InterpreterState {
+  // Its own copy of builtin_table, and its env on top of that
+  lref builtins;
+  lref env;
+  unsigned long global_epoch = 1;
+  unsigned long generic_epoch = 1;
+  bool in_debugger = false;
+  std::string debugger_last_command;
+  std::shared_ptr<OutputPort> stdout_port;
+  std::shared_ptr<OutputPort> output;
+  int jit_threshold = 100;
+};
+
+/*
+  An interpreter with its own env, debugger, output and caches. Scripts in one
+  can't see anything another one defines, so a program can run as many as it
+  wants, each on its own thread if it likes:
+
+    Interpreter level;
+    level.load_stdlib();
+    level.eval("(defun on-tick (n) (* n 2))");
+    auto result = level.eval("(on-tick 21)");
+
+  One interpreter can only be running on one thread at a time; eval throws if
+  another thread is already in it. Calling back into the same interpreter from a
+  builtin it's running is fine.
+
+  What all of them share: Nil, True, False, small ints and the builtin functions
+  themselves, which never change, and the file table and gensym counter, which
+  are locked or atomic. Values can be handed from one interpreter to another as
+  long as two threads aren't changing them at once. stdout is shared too, but
+  each interpreter buffers its own output, so what they print can interleave a
+  buffer at a time.
+
+  Errors come out as lisp_errors, same as anywhere else.
+*/
+class Interpreter {
+  public:
+    Interpreter();
+    Interpreter(const Interpreter&) = delete;
+    Interpreter& operator=(const Interpreter&) = delete;
+    ~Interpreter();
+
+    // Every top level form in source, in order. Returns the last one's value.
+    lref eval(std::string_view source);
+    lref eval(const lref& form);
+    void load_file(const std::string& path);
+    // Imports the standard library the same way the REPL does before it starts
+    void load_stdlib();
+
+    // Throw a budget_error if they run out of budget partway through
+    lref eval(std::string_view source, const Budget& budget);
+    lref eval(const lref& form, const Budget& budget);
+    // Runs coroutine until it yields, returns or runs out of budget. When it runs
+    // out it's left suspended with out_of_fuel set, so the next call carries on from
+    // there. Pretty much what a frame loop wants:
+    //
+    //   auto co = make_coroutine(level.get("behaviour"), {});
+    //   while (!done) {
+    //     level.resume(*co, Budget::for_time(2ms));
+    //     ...
+    //   }
+    lref resume(Coroutine& coroutine, const Budget& budget, const lref& value = Nil);
+
+    // nullptr if name isn't defined
+    lref get(const std::string& name);
+    void set(const std::string& name, const lref& value);
+
+    // Makes interpreter the current one on this thread until it goes away. Nests,
+    // and puts back whatever was running before.
+    class Scope {
+      public:
+        Scope(Interpreter& interpreter);
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+        ~Scope();
+      private:
+        Interpreter& interpreter;
+        Interpreter* previous;
+        // Already running on this thread, so there's nothing to swap
+        bool reentered;
+    };
+
+  private:
+    // Holds the thread_locals of whatever ran before while this one is running
+    InterpreterState state;
+    std::atomic<bool> running{false};
+};
+
+/*
+  Lends whatever interpreter's running on this thread to other threads, for pmap.
+  Make one of these with the state on the thread that owns the interpreter, and a
+  SharedScope with it on each thread that helps. They all see the same env, so
+  Gel_in_parallel gets set to stop any of them changing it.
+*/
+InterpreterState share_current_state();
+
+class SharedScope {
+  public:
+    SharedScope(const InterpreterState& shared);
+    SharedScope(const SharedScope&) = delete;
+    SharedScope& operator=(const SharedScope&) = delete;
+    ~SharedScope();
+  private:
+    InterpreterState state;
+    bool was_parallel;
+};
+
+#endif
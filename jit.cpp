@@ -0,0 +1,503 @@
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+
+#include "jit.h"
+#include "budget.h"
+#include "evaluator.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#define GEL_JIT_X86_64
+#include <sys/mman.h>
+#endif
+
+thread_local int jit_threshold = 100;
+
+#ifdef GEL_JIT_X86_64
+
+struct JitCode {
+    void* mem;
+    size_t size;
+    int (*entry)(VMState* vm, unsigned long pc);
+
+    JitCode(void* mem, size_t size) : mem(mem), size(size),
+        entry(reinterpret_cast<int (*)(VMState*, unsigned long)>(mem)) {}
+    ~JitCode() { munmap(mem, size); }
+};
+
+// C++ exceptions can't unwind through the generated code, since there's no unwind
+// info for it. So anything that can throw gets caught here and handed back as
+// VMExit::ERROR, and run_vm rethrows it once we're out.
+template<void (*op)(VMState&, const Instruction&)>
+int jit_guarded(VMState* vm, const Instruction* instruction, unsigned long pc) {
+    try {
+        vm->pc = pc;
+        op(*vm, *instruction);
+        return 0;
+    } catch (...) {
+        vm->error = std::current_exception();
+        return 1;
+    }
+}
+
+template<void (*op)(VMState&, const Instruction&)>
+int jit_plain(VMState* vm, const Instruction* instruction, unsigned long) {
+    op(*vm, *instruction);
+    return 0;
+}
+
+int jit_ret(VMState* vm, const Instruction* instruction, unsigned long pc) {
+    vm->pc = pc;
+    return (int)vm_ret(*vm, *instruction);
+}
+
+// 0 to carry on in this block, otherwise 1 + the VMExit to leave with
+int jit_call_global(VMState* vm, const Instruction* instruction, unsigned long pc) {
+    try {
+        vm->pc = pc;
+        return vm_call_global(*vm, *instruction) ? 1 + (int)VMExit::TRANSFER : 0;
+    } catch (...) {
+        vm->error = std::current_exception();
+        return 1 + (int)VMExit::ERROR;
+    }
+}
+
+int jit_tailcall_global(VMState* vm, const Instruction* instruction, unsigned long pc) {
+    try {
+        vm->pc = pc;
+        return (int)vm_tailcall_global(*vm, *instruction);
+    } catch (...) {
+        vm->error = std::current_exception();
+        return (int)VMExit::ERROR;
+    }
+}
+
+int jit_throw(VMState* vm, const Instruction* instruction, unsigned long pc) {
+    try {
+        vm->pc = pc;
+        return (int)vm_throw(*vm, *instruction);
+    } catch (...) {
+        vm->error = std::current_exception();
+        return (int)VMExit::ERROR;
+    }
+}
+
+int jit_yield(VMState* vm, const Instruction* instruction, unsigned long pc) {
+    vm->pc = pc;
+    return (int)vm_yield(*vm, *instruction);
+}
+
+int jit_pop_truthy(VMState* vm) {
+    return vm_pop_truthy(*vm);
+}
+
+// 0 or 1 for which way the JIF goes, 2 if the comparison threw
+int jit_pop_compare(VMState* vm, const Instruction* instruction, unsigned long pc) {
+    try {
+        vm->pc = pc;
+        return vm_pop_compare(*vm, *instruction);
+    } catch (...) {
+        vm->error = std::current_exception();
+        return 2;
+    }
+}
+
+// Only gets called once the inline decrement of vm->fuel goes negative. 0 to take
+// the jump, 1 to leave with VMExit::OUT_OF_FUEL.
+int jit_out_of_fuel(VMState* vm, const Instruction*, unsigned long target) {
+    if (fuel_tank.refill()) {
+        return 0;
+    }
+    vm->pc = target;
+    return 1;
+}
+
+// Where VMState keeps its fuel pointer, for the templates to load it from
+static const int32_t fuel_offset = [] {
+    VMState vm;
+    return (int32_t)(reinterpret_cast<char*>(&vm.fuel) - reinterpret_cast<char*>(&vm));
+}();
+
+static int32_t vm_offset(const void* vm, const void* field) {
+    return (int32_t)(static_cast<const char*>(field) - static_cast<const char*>(vm));
+}
+
+static const int32_t stack_offset = [] {
+    VMState vm;
+    return vm_offset(&vm, &vm.stack);
+}();
+
+static const int32_t stack_size_offset = [] {
+    VMState vm;
+    return vm_offset(&vm, &vm.stack_size);
+}();
+
+static const int32_t base_offset = [] {
+    VMState vm;
+    return vm_offset(&vm, &vm.base);
+}();
+
+// PUSH and LOAD_ARG copy their lref onto the stack inline, which means knowing how
+// shared_ptr and vector lay themselves out: the object then the control block, the
+// use count 8 bytes into that, and the vector's data pointer first. Checked once
+// here, and if any of it's off they call vm_push and vm_load_arg like everything else.
+static const bool inline_copies = [] {
+    if (sizeof(lref) != 16) {
+        return false;
+    }
+    lref a = std::make_shared<LispInt>(1);
+    lref b = a;
+    void* words[2];
+    std::memcpy(words, &a, sizeof(words));
+    if (words[0] != a.get() || words[1] == nullptr) {
+        return false;
+    }
+    int32_t count;
+    std::memcpy(&count, static_cast<char*>(words[1]) + 8, sizeof(count));
+    if (count != a.use_count()) {
+        return false;
+    }
+
+    VMState vm;
+    vm.stack.resize(1);
+    void* data;
+    std::memcpy(&data, reinterpret_cast<char*>(&vm) + stack_offset, sizeof(data));
+    return data == vm.stack.data();
+}();
+
+template<typename Fn>
+const void* fn_addr(Fn* fn) {
+    return reinterpret_cast<const void*>(fn);
+}
+
+// Just enough of an assembler for the templates below. Jumps are emitted with a
+// placeholder and patched once every label has an address.
+struct Emitter {
+    std::vector<uint8_t> bytes;
+    // Offset of a rel32 and the label it points at
+    std::vector<std::pair<size_t, int>> fixups;
+
+    void u8(uint8_t b) { bytes.push_back(b); }
+    void u32(uint32_t v) { for (int i = 0; i < 4; i++) u8(v >> (8 * i)); }
+    void u64(uint64_t v) { for (int i = 0; i < 8; i++) u8(v >> (8 * i)); }
+    void rel32(int label) { fixups.push_back({bytes.size(), label}); u32(0); }
+
+    void mov_eax(uint32_t v) { u8(0xB8); u32(v); }
+    void jmp(int label) { u8(0xE9); rel32(label); }
+    void jnz(int label) { u8(0x0F); u8(0x85); rel32(label); }
+    void jz(int label) { u8(0x0F); u8(0x84); rel32(label); }
+    void jge(int label) { u8(0x0F); u8(0x8D); rel32(label); }
+    void ja(int label) { u8(0x0F); u8(0x87); rel32(label); }
+    void test_eax() { u8(0x85); u8(0xC0); }
+    void cmp_eax(uint8_t v) { u8(0x83); u8(0xF8); u8(v); }
+
+    // Short jumps within a template: emit one, then land it where it should go
+    size_t jcc8(uint8_t op) { u8(op); u8(0); return bytes.size() - 1; }
+    void land8(size_t at) { bytes[at] = bytes.size() - (at + 1); }
+
+    // Calls fn(vm) or fn(vm, instruction, pc), result in eax
+    void call(const void* fn, const Instruction* instruction, unsigned long pc) {
+        u8(0x48); u8(0x89); u8(0xDF);  // mov rdi, rbx
+        if (instruction != nullptr) {
+            u8(0x48); u8(0xBE); u64((uint64_t)instruction);  // mov rsi, imm64
+            u8(0xBA); u32(pc);                                // mov edx, imm32
+        }
+        u8(0x48); u8(0xB8); u64((uint64_t)fn);  // mov rax, imm64
+        u8(0xFF); u8(0xD0);                     // call rax
+    }
+
+    // Pushes a copy of the lref at rdx, leaving rax pointing at the stack. Whatever
+    // was in the slot it goes into should already be null, and if it isn't, fallback
+    // (the same instruction through its helper) deals with it.
+    void inline_copy(const void* fallback, const Instruction* instruction, unsigned long pc) {
+        u8(0x48); u8(0x63); u8(0x8B); u32(stack_size_offset);  // movsxd rcx, [rbx + stack_size]
+        u8(0x48); u8(0xC1); u8(0xE1); u8(0x04);               // shl rcx, 4
+        u8(0x48); u8(0x01); u8(0xC1);                         // add rcx, rax
+        u8(0x48); u8(0x83); u8(0x79); u8(0x08); u8(0x00);     // cmp qword [rcx + 8], 0
+        size_t slow = jcc8(0x75);                             // jne slow
+        u8(0x48); u8(0x8B); u8(0x32);                         // mov rsi, [rdx]
+        u8(0x48); u8(0x8B); u8(0x52); u8(0x08);               // mov rdx, [rdx + 8]
+        u8(0x48); u8(0x85); u8(0xD2);                         // test rdx, rdx
+        size_t null = jcc8(0x74);                             // jz null
+        u8(0xF0); u8(0x83); u8(0x42); u8(0x08); u8(0x01);     // lock add dword [rdx + 8], 1
+        land8(null);
+        u8(0x48); u8(0x89); u8(0x31);                         // mov [rcx], rsi
+        u8(0x48); u8(0x89); u8(0x51); u8(0x08);               // mov [rcx + 8], rdx
+        u8(0x83); u8(0x83); u32(stack_size_offset); u8(0x01); // add dword [rbx + stack_size], 1
+        size_t done = jcc8(0xEB);                             // jmp done
+        land8(slow);
+        call(fallback, instruction, pc);
+        land8(done);
+    }
+
+    void load_stack() {
+        u8(0x48); u8(0x8B); u8(0x83); u32(stack_offset);  // mov rax, [rbx + stack]
+    }
+
+    void push(const Instruction* instruction, unsigned long pc) {
+        load_stack();
+        u8(0x48); u8(0xBA); u64((uint64_t)&instruction->operand);  // mov rdx, imm64
+        inline_copy(fn_addr(&jit_plain<vm_push>), instruction, pc);
+    }
+
+    void load_arg(const Instruction* instruction, unsigned long pc) {
+        load_stack();
+        u8(0x48); u8(0x63); u8(0x93); u32(base_offset);        // movsxd rdx, [rbx + base]
+        u8(0x48); u8(0x81); u8(0xC2); u32(instruction->n);     // add rdx, n
+        u8(0x48); u8(0xC1); u8(0xE2); u8(0x04);                // shl rdx, 4
+        u8(0x48); u8(0x01); u8(0xC2);                          // add rdx, rax
+        inline_copy(fn_addr(&jit_plain<vm_load_arg>), instruction, pc);
+    }
+
+    // Jumps to target, taking a tick of fuel first. When that runs the tank dry
+    // it asks for more and leaves with VMExit::OUT_OF_FUEL if there isn't any.
+    void fueled_jmp(const Instruction* instruction, int target, int epilogue) {
+        u8(0x48); u8(0x8B); u8(0x83); u32(fuel_offset);  // mov rax, [rbx + fuel]
+        u8(0x48); u8(0x83); u8(0x28); u8(0x01);          // sub qword [rax], 1
+        jge(target);
+        call(fn_addr(&jit_out_of_fuel), instruction, target);
+        test_eax();
+        jz(target);
+        mov_eax((uint32_t)VMExit::OUT_OF_FUEL);
+        jmp(epilogue);
+    }
+};
+
+/*
+  Layout:
+    prologue: save rbx, keep the VMState in it, jump through the table to the pc
+              we were asked to start at
+    one template per instruction
+    end:      fell off the end
+    error:    a helper threw
+    epilogue: restore rbx and return the VMExit in eax
+    table:    native address of every pc, plus the end
+*/
+std::shared_ptr<JitCode> jit_compile(const Bytecode& block) {
+    const auto& code = block.code;
+    int size = code.size();
+    int end_label = size;
+    int error_label = size + 1;
+    int epilogue_label = size + 2;
+    std::vector<size_t> labels(size + 3);
+    Emitter e;
+
+    e.u8(0x53);                          // push rbx (also lines the stack up for calls)
+    e.u8(0x48); e.u8(0x89); e.u8(0xFB);  // mov rbx, rdi
+    e.u8(0x89); e.u8(0xF6);              // mov esi, esi
+    e.u8(0x48); e.u8(0x8D); e.u8(0x05);  // lea rax, [rip + table]
+    size_t table_fixup = e.bytes.size();
+    e.u32(0);
+    e.u8(0xFF); e.u8(0x24); e.u8(0xF0);  // jmp [rax + rsi * 8]
+
+    for (int pc = 0; pc < size; pc++) {
+        labels[pc] = e.bytes.size();
+        const auto& instruction = code[pc];
+        switch (instruction.code) {
+            case Opcode::PUSH:
+                if (inline_copies) {
+                    e.push(&instruction, pc);
+                } else {
+                    e.call(fn_addr(&jit_plain<vm_push>), &instruction, pc);
+                }
+                break;
+            case Opcode::POP:
+                e.call(fn_addr(&jit_plain<vm_pop>), &instruction, pc);
+                break;
+            case Opcode::LOAD_ARG:
+                if (inline_copies) {
+                    e.load_arg(&instruction, pc);
+                } else {
+                    e.call(fn_addr(&jit_plain<vm_load_arg>), &instruction, pc);
+                }
+                break;
+            case Opcode::CONS:
+                e.call(fn_addr(&jit_guarded<vm_cons>), &instruction, pc);
+                e.test_eax();
+                e.jnz(error_label);
+                break;
+            case Opcode::CALL_BUILTIN:
+                e.call(fn_addr(&jit_guarded<vm_call_builtin>), &instruction, pc);
+                e.test_eax();
+                e.jnz(error_label);
+                break;
+            case Opcode::ADD:
+            case Opcode::SUB:
+            case Opcode::MUL:
+            case Opcode::DIV:
+            case Opcode::MOD:
+            case Opcode::LT:
+            case Opcode::GT:
+            case Opcode::EQ:
+                // Straight into a JIF, the comparison decides the jump itself. The
+                // JIF still gets its own code after this for anything jumping to it.
+                if (pc + 1 < size && code[pc + 1].code == Opcode::JIF
+                    && (instruction.code == Opcode::LT || instruction.code == Opcode::GT
+                        || instruction.code == Opcode::EQ)) {
+                    int target = code[pc + 1].n;
+                    e.call(fn_addr(&jit_pop_compare), &instruction, pc);
+                    e.cmp_eax(1);
+                    e.ja(error_label);
+                    e.jnz(pc + 2);
+                    if (target <= pc + 1) {
+                        e.fueled_jmp(&code[pc + 1], target, epilogue_label);
+                    } else {
+                        e.jmp(target);
+                    }
+                    break;
+                }
+                e.call(fn_addr(&jit_guarded<vm_binary_op>), &instruction, pc);
+                e.test_eax();
+                e.jnz(error_label);
+                break;
+            case Opcode::CALL:
+            case Opcode::TAILCALL:
+                e.call(instruction.code == Opcode::CALL
+                       ? fn_addr(&jit_guarded<vm_call>)
+                       : fn_addr(&jit_guarded<vm_tailcall>), &instruction, pc);
+                e.test_eax();
+                e.jnz(error_label);
+                e.mov_eax((uint32_t)VMExit::TRANSFER);
+                e.jmp(epilogue_label);
+                break;
+            case Opcode::RET:
+                e.call(fn_addr(&jit_ret), &instruction, pc);
+                e.jmp(epilogue_label);
+                break;
+            case Opcode::CALL_GLOBAL:
+                e.call(fn_addr(&jit_call_global), &instruction, pc);
+                e.test_eax();
+                e.u8(0x74); e.u8(0x07);  // jz past the next two
+                e.u8(0xFF); e.u8(0xC8);  // dec eax
+                e.jmp(epilogue_label);
+                break;
+            case Opcode::TAILCALL_GLOBAL:
+                e.call(fn_addr(&jit_tailcall_global), &instruction, pc);
+                e.jmp(epilogue_label);
+                break;
+            case Opcode::THROW:
+                e.call(fn_addr(&jit_throw), &instruction, pc);
+                e.jmp(epilogue_label);
+                break;
+            case Opcode::YIELD:
+                e.call(fn_addr(&jit_yield), &instruction, pc);
+                e.jmp(epilogue_label);
+                break;
+            case Opcode::JIF:
+                e.call(fn_addr(&jit_pop_truthy), nullptr, pc);
+                e.test_eax();
+                // Backwards ones cost fuel, same as in the interpreter
+                if (instruction.n <= pc) {
+                    e.jz(pc + 1);
+                    e.fueled_jmp(&instruction, instruction.n, epilogue_label);
+                } else {
+                    e.jnz(instruction.n);
+                }
+                break;
+            case Opcode::JMP:
+                if (instruction.n <= pc) {
+                    e.fueled_jmp(&instruction, instruction.n, epilogue_label);
+                } else {
+                    e.jmp(instruction.n);
+                }
+                break;
+            default:
+                return nullptr;
+        }
+    }
+
+    labels[end_label] = e.bytes.size();
+    e.mov_eax((uint32_t)VMExit::END);
+    e.jmp(epilogue_label);
+    labels[error_label] = e.bytes.size();
+    e.mov_eax((uint32_t)VMExit::ERROR);
+    labels[epilogue_label] = e.bytes.size();
+    e.u8(0x5B);  // pop rbx
+    e.u8(0xC3);  // ret
+
+    for (const auto& [at, label] : e.fixups) {
+        int32_t rel = labels[label] - (at + 4);
+        std::memcpy(&e.bytes[at], &rel, 4);
+    }
+
+    while (e.bytes.size() % 8 != 0) {
+        e.u8(0xCC);  // int3
+    }
+    size_t table = e.bytes.size();
+    int32_t table_rel = table - (table_fixup + 4);
+    std::memcpy(&e.bytes[table_fixup], &table_rel, 4);
+
+    size_t total = table + 8 * (size + 1);
+    auto mem = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return nullptr;
+    }
+    auto jit = std::make_shared<JitCode>(mem, total);
+
+    auto base = static_cast<uint8_t*>(mem);
+    std::memcpy(base, e.bytes.data(), e.bytes.size());
+    for (int pc = 0; pc <= size; pc++) {
+        uint64_t addr = (uint64_t)(base + labels[pc]);
+        std::memcpy(base + table + 8 * pc, &addr, 8);
+    }
+
+    if (mprotect(mem, total, PROT_READ | PROT_EXEC) != 0) {
+        return nullptr;
+    }
+    return jit;
+}
+
+bool jit_supported() {
+    return true;
+}
+
+// Held while compiling, so a block only ever gets compiled once
+static std::mutex jit_lock;
+
+bool jit_ready(Bytecode& block) {
+    if (jit_threshold < 0) {
+        return false;
+    }
+    if (block.jit_code.load(std::memory_order_acquire) != nullptr) {
+        return true;
+    }
+    // Other threads could be running the block, so it waits until after
+    if (Gel_in_parallel) {
+        return false;
+    }
+    if (block.jit_failed.load(std::memory_order_relaxed)
+        || block.exec_count.fetch_add(1, std::memory_order_relaxed) < jit_threshold) {
+        return false;
+    }
+
+    // Something else could have got here first
+    std::lock_guard<std::mutex> lock(jit_lock);
+    if (block.jit == nullptr && !block.jit_failed) {
+        block.jit = jit_compile(block);
+        block.jit_failed = block.jit == nullptr;
+        block.jit_code.store(block.jit.get(), std::memory_order_release);
+    }
+    return block.jit != nullptr;
+}
+
+VMExit jit_run(Bytecode& block, VMState& vm) {
+    return (VMExit)block.jit_code.load(std::memory_order_acquire)->entry(&vm, vm.pc);
+}
+
+#else
+
+struct JitCode {};
+
+bool jit_supported() {
+    return false;
+}
+
+bool jit_ready(Bytecode&) {
+    return false;
+}
+
+VMExit jit_run(Bytecode&, VMState&) {
+    throw vm_error("No JIT on this architecture.");
+}
+
+#endif
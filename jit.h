@@ -0,0 +1,36 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "vm.h"
+
+/*
+  Baseline JIT for the stack VM.
+
+  Once a block has been entered jit_threshold times, its instructions get turned
+  into x86-64 machine code, one fixed template per opcode. Most templates call the
+  same vm_* functions the interpreter does, so for those all the JIT gets rid of is
+  dispatch: fetching the next instruction, the switch, and decoding jumps. Jumps
+  inside the block become real jumps. PUSH and LOAD_ARG copy their value onto the
+  stack inline, and an LT, GT or EQ going straight into a JIF jumps on the result
+  without pushing a boolean first.
+
+  Native code works on the same VMState as the interpreter and gives control back
+  whenever it leaves the block, so the two can be mixed freely. Anywhere else this
+  is a no-op and everything stays in the interpreter.
+*/
+
+// Entries into a block before it gets compiled. 0 compiles everything the first
+// time it runs, anything negative turns the JIT off.
+extern thread_local int jit_threshold;
+
+// Whether this build can make native code at all
+bool jit_supported();
+
+// Counts an entry into the block and compiles it if it just got hot. True if the
+// block has native code to run.
+bool jit_ready(Bytecode& block);
+
+// Runs the block's native code from vm.pc
+VMExit jit_run(Bytecode& block, VMState& vm);
+
+#endif
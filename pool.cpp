@@ -0,0 +1,254 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "pool.h"
+
+namespace {
+
+// What's left for one thread to do. Padded so threads taking chunks off their own
+// ranges don't fight over a cache line.
+struct alignas(64) Range {
+  std::mutex lock;
+  size_t begin = 0;
+  size_t end = 0;
+};
+
+struct Job {
+  size_t chunk;
+  const std::function<void(size_t, size_t)>* body;
+  std::unique_ptr<Range[]> ranges;
+  size_t nranges;
+
+  std::atomic<bool> failed{false};
+  std::mutex error_lock;
+  std::exception_ptr error;
+  size_t error_at = 0;
+};
+
+// Takes up to chunk items off the front of range. False if it's empty.
+bool take(Range& range, size_t chunk, size_t& begin, size_t& end) {
+  std::lock_guard<std::mutex> lock(range.lock);
+  if (range.begin >= range.end) {
+    return false;
+  }
+  begin = range.begin;
+  end = std::min(range.end, begin + chunk);
+  range.begin = end;
+  return true;
+}
+
+// Moves the back half of the fullest other range into ours. False if everything's
+// been taken.
+bool steal(Job& job, size_t self) {
+  while (true) {
+    size_t victim = job.nranges;
+    size_t most = 0;
+    for (size_t i = 0; i < job.nranges; i++) {
+      if (i == self) {
+        continue;
+      }
+      std::lock_guard<std::mutex> lock(job.ranges[i].lock);
+      if (job.ranges[i].end - job.ranges[i].begin > most) {
+        most = job.ranges[i].end - job.ranges[i].begin;
+        victim = i;
+      }
+    }
+    if (victim == job.nranges) {
+      return false;
+    }
+
+    size_t begin, end;
+    {
+      std::lock_guard<std::mutex> lock(job.ranges[victim].lock);
+      auto& range = job.ranges[victim];
+      if (range.begin >= range.end) {
+        // Someone got there first, look again
+        continue;
+      }
+      begin = range.begin + (range.end - range.begin) / 2;
+      end = range.end;
+      range.end = begin;
+    }
+
+    std::lock_guard<std::mutex> lock(job.ranges[self].lock);
+    job.ranges[self].begin = begin;
+    job.ranges[self].end = end;
+    return true;
+  }
+}
+
+// Set while a thread's doing a job, so anything it starts runs right there
+thread_local bool in_job = false;
+
+struct InJob {
+  InJob() { in_job = true; }
+  ~InJob() { in_job = false; }
+};
+
+void work(Job& job, size_t self) {
+  InJob scope;
+  size_t begin, end;
+  while (!job.failed) {
+    if (!take(job.ranges[self], job.chunk, begin, end)) {
+      if (!steal(job, self)) {
+        return;
+      }
+      continue;
+    }
+    try {
+      (*job.body)(begin, end);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(job.error_lock);
+      if (job.error == nullptr || begin < job.error_at) {
+        job.error = std::current_exception();
+        job.error_at = begin;
+      }
+      job.failed = true;
+    }
+  }
+}
+
+class Pool {
+  public:
+    ~Pool() { stop(); }
+
+    int size() {
+      return wanted;
+    }
+
+    void resize(int size) {
+      std::lock_guard<std::mutex> lock(busy);
+      stop();
+      wanted = std::max(size, 1);
+    }
+
+    void run(size_t n, size_t chunk, const std::function<void(size_t, size_t)>& body) {
+      std::unique_lock<std::mutex> running(busy, std::defer_lock);
+      if (in_job || !running.try_lock() || wanted == 1 || n <= chunk) {
+        pool_stats.serial++;
+        for (size_t begin = 0; begin < n; begin += chunk) {
+          body(begin, std::min(n, begin + chunk));
+        }
+        return;
+      }
+      start();
+      pool_stats.parallel++;
+
+      Job job;
+      job.chunk = chunk;
+      job.body = &body;
+      job.nranges = threads.size() + 1;
+      job.ranges.reset(new Range[job.nranges]);
+      for (size_t i = 0; i < job.nranges; i++) {
+        job.ranges[i].begin = n * i / job.nranges;
+        job.ranges[i].end = n * (i + 1) / job.nranges;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        current = &job;
+        active = threads.size();
+        generation++;
+      }
+      wake.notify_all();
+
+      // The caller's range is the last one
+      work(job, job.nranges - 1);
+
+      std::unique_lock<std::mutex> lock(mutex);
+      done.wait(lock, [this] { return active == 0; });
+      current = nullptr;
+      lock.unlock();
+
+      if (job.error != nullptr) {
+        std::rethrow_exception(job.error);
+      }
+    }
+
+  private:
+    // Held by whoever's running a job, or resizing
+    std::mutex busy;
+    std::atomic<int> wanted{std::max(1, (int)std::thread::hardware_concurrency())};
+    std::vector<std::thread> threads;
+
+    // Everything below goes with mutex
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    Job* current = nullptr;
+    unsigned long generation = 0;
+    size_t active = 0;
+    bool stopping = false;
+
+    void start() {
+      unsigned long seen;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        seen = generation;
+      }
+      while ((int)threads.size() < wanted - 1) {
+        size_t self = threads.size();
+        threads.emplace_back([this, self, seen] { loop(self, seen); });
+      }
+    }
+
+    void stop() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+      }
+      wake.notify_all();
+      for (auto& thread : threads) {
+        thread.join();
+      }
+      threads.clear();
+      stopping = false;
+    }
+
+    // seen is the last job it's not meant to do
+    void loop(size_t self, unsigned long seen) {
+      while (true) {
+        Job* job;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          wake.wait(lock, [&] { return stopping || generation != seen; });
+          if (stopping) {
+            return;
+          }
+          seen = generation;
+          job = current;
+        }
+
+        work(*job, self);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--active == 0) {
+          done.notify_all();
+        }
+      }
+    }
+};
+
+Pool pool;
+
+}  // namespace
+
+PoolStats pool_stats;
+
+int pool_size() {
+  return pool.size();
+}
+
+void set_pool_size(int size) {
+  pool.resize(size);
+}
+
+void parallel_for(size_t n, size_t chunk, const std::function<void(size_t, size_t)>& body) {
+  pool.run(n, std::max(chunk, (size_t)1), body);
+}
@@ -0,0 +1,41 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+
+/*
+  Work-stealing thread pool, for pmap and preduce.
+
+  parallel_for splits [0, n) evenly between the threads up front. Each one takes
+  chunk items at a time off the front of its own range, and once that's empty it
+  steals the back half of whichever range has the most left. Threads that got
+  cheap items end up helping with the expensive ones, and nobody touches a lock
+  more than once a chunk.
+
+  The threads get started the first time they're needed and stick around after.
+  The thread calling parallel_for does its share too, so a pool of n has n - 1
+  threads of its own. If the pool's already busy, which is what happens when
+  parallel_for gets called from inside parallel_for or from two interpreters at
+  once, it just runs everything on the calling thread.
+
+  If body throws, the rest of the chunks get skipped, and once everything's
+  stopped the error from the earliest chunk gets rethrown.
+*/
+
+// Threads parallel_for uses, counting the caller. Starts out as one per core.
+int pool_size();
+void set_pool_size(int size);
+
+// For the whole process. parallel counts the jobs that got handed out to the
+// threads, serial the ones that ran on the caller.
+struct PoolStats {
+  std::atomic<unsigned long> parallel{0};
+  std::atomic<unsigned long> serial{0};
+};
+extern PoolStats pool_stats;
+
+void parallel_for(size_t n, size_t chunk, const std::function<void(size_t, size_t)>& body);
+
+#endif
@@ -0,0 +1,73 @@
+#include <cerrno>
+#include <cstring>
+#include <typeinfo>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "port.h"
+
+void OutputPort::write(const lref& obj) {
+  // Skip the copy str() would make
+  if (obj != nullptr && typeid(*obj) == typeid(String)) {
+    write(std::string_view(static_cast<const String*>(obj.get())->value));
+    return;
+  }
+  write(std::string_view(try_str(obj)));
+}
+
+FilePort::FilePort(int fd, std::string name, bool owns_fd)
+  : OutputPort(std::move(name), isatty(fd)), fd(fd), owns_fd(owns_fd) {
+  buffer.reserve(GEL_PORT_BUFFER);
+}
+
+FilePort::~FilePort() {
+  try {
+    close();
+  } catch (const lisp_error&) {
+    // Nowhere to report it from here
+  }
+}
+
+void FilePort::flush() {
+  if (fd < 0 && !buffer.empty()) {
+    buffer.clear();
+    throw port_error("Port " + name + " is closed.");
+  }
+
+  size_t written = 0;
+  while (written < buffer.size()) {
+    auto n = ::write(fd, buffer.data() + written, buffer.size() - written);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      buffer.clear();
+      throw port_error("Error writing " + name + ": " + std::strerror(errno));
+    }
+    written += n;
+  }
+  buffer.clear();
+}
+
+void FilePort::close() {
+  if (fd < 0) {
+    return;
+  }
+  flush();
+  if (owns_fd) {
+    ::close(fd);
+  }
+  fd = -1;
+}
+
+std::shared_ptr<FilePort> open_output_file(const std::string& path) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    throw port_error("Couldn't open " + path + ": " + std::strerror(errno));
+  }
+  return std::make_shared<FilePort>(fd, path, true);
+}
+
+thread_local std::shared_ptr<OutputPort> stdout_port;
+thread_local std::shared_ptr<OutputPort> current_output;
@@ -0,0 +1,86 @@
+#ifndef PORT_H
+#define PORT_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include "types.h"
+
+struct port_error : public lisp_error { using lisp_error::lisp_error; };
+
+/*
+  Output ports.
+
+  Everything prn and put write goes into a port's buffer, and only gets handed to
+  the OS when the buffer fills up or something flushes it. Stdout flushes on
+  newlines too when it's a terminal, so interactive output still shows up right
+  away, but piped to a file it's one write per GEL_PORT_BUFFER bytes instead of one
+  per line.
+
+  A string port is the same thing with a buffer that never gets flushed, so
+  printing to a string takes the same path as printing to a file.
+*/
+const size_t GEL_PORT_BUFFER = 1 << 16;
+
+struct OutputPort : LispObject {
+  std::string name;
+
+  OutputPort(std::string name, bool line_buffered = false)
+    : name(std::move(name)), line_buffered(line_buffered) {}
+  virtual ~OutputPort() = default;
+  std::string repr() const { return "<port " + name + ">"; }
+  std::string type_string() const { return "output-port"; }
+
+  void write(std::string_view str) {
+    buffer.append(str);
+    if (buffer.size() >= GEL_PORT_BUFFER
+        || (line_buffered && str.find('\n') != std::string_view::npos)) {
+      flush();
+    }
+  }
+  // Strings get written as they are, everything else as its repr
+  void write(const lref& obj);
+  virtual void flush() {}
+
+  // Held by prn and put while threads in a pmap are writing to it
+  std::mutex lock;
+
+protected:
+  std::string buffer;
+  bool line_buffered;
+};
+
+struct FilePort : OutputPort {
+  FilePort(int fd, std::string name, bool owns_fd);
+  ~FilePort();
+  void flush();
+  void close();
+
+private:
+  int fd;
+  bool owns_fd;
+};
+
+struct StringPort : OutputPort {
+  StringPort() : OutputPort("string") {}
+  const std::string& contents() const { return buffer; }
+};
+
+std::shared_ptr<FilePort> open_output_file(const std::string& path);
+
+// Where prn and put go. Starts out as stdout_port. Each interpreter has its own
+// of both, see interpreter.h.
+extern thread_local std::shared_ptr<OutputPort> current_output;
+extern thread_local std::shared_ptr<OutputPort> stdout_port;
+
+// Anything that writes to std::cout directly has to call this first or it'll
+// come out ahead of whatever's still in the buffer
+inline void flush_stdout() {
+  if (stdout_port != nullptr) {
+    stdout_port->flush();
+  }
+}
+
+#endif
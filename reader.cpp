@@ -1,70 +1,203 @@
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
 #include <limits.h>
-#include <regex>
+#include <mutex>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#include "regex.h"
 #include "reader.h"
 
 static const lref CloseParen = std::make_shared<LispObject>();
 static const lref CloseBrace = std::make_shared<LispObject>();
 
-// Yes, this is godawful. Need to escape backslashes for cpp and then
-// AGAIN for regex. Fuck.
-// cpp escapes "\\\\\"" to "\\\""
-// regex escapes that to "\""
-static const auto backslash_quote_regex = std::regex("\\\\\"");
+// Readers can be made on any thread, so the file table is locked
+static std::mutex file_table_lock;
+static std::vector<std::string> file_names = {""};
+static std::unordered_map<std::string, uint32_t> file_ids = {{"", 0}};
 
-// TODO: can't rely on this. Need to hash on the pointer because a pointer can have
-// whatever size
-std::unordered_map<unsigned long, Linum> line_table;
+uint32_t intern_file(const std::string& filename) {
+  std::lock_guard<std::mutex> guard(file_table_lock);
+  auto it = file_ids.find(filename);
+  if (it != file_ids.end()) {
+    return it->second;
+  }
 
-const char* Reader::next() {
-  // Returns and consumes the next token
+  uint32_t id = file_names.size();
+  file_names.push_back(filename);
+  file_ids[filename] = id;
+  return id;
+}
 
-  if (idx >= input.size()) {
-    return nullptr;
+std::string file_name(uint32_t file) {
+  std::lock_guard<std::mutex> guard(file_table_lock);
+  return file < file_names.size() ? file_names[file] : "";
+}
+
+std::string source_location(const lref& form) {
+  auto as_cons = dynamic_cast<Cons*>(form.get());
+  if (as_cons == nullptr) {
+    return ":0";
   }
+  return file_name(as_cons->file) + ":" + std::to_string(as_cons->line);
+}
 
-  return this->input[idx++].c_str();
+static bool is_delimiter(char c) {
+  switch (c) {
+    case '(': case ')': case '[': case ']': case '{': case '}':
+    case '\'': case '`': case ',': case '"': case ';':
+      return true;
+    default:
+      return false;
+  }
 }
 
-const char* Reader::peek() {
-  // Returns the next token but does not consume it.
-  if (idx >= input.size()) {
-    return nullptr;
+static bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+Reader::~Reader() {
+  if (owns_fd) {
+    close(fd);
+  }
+}
+
+// Whether there's a character at pos + n, reading more of the file if there's a
+// file to read and we've run out. Reading more can move the buffer, so only the
+// token being scanned survives it, and only as offsets.
+bool Reader::avail(size_t n) {
+  while (pos + n >= input.size()) {
+    if (fd < 0 || at_eof) {
+      return false;
+    }
+
+    // Everything before the token we're in the middle of has been used up
+    buffer.erase(0, token_start);
+    pos -= token_start;
+    token_start = 0;
+
+    size_t old_size = buffer.size();
+    buffer.resize(old_size + GEL_READ_CHUNK);
+    ssize_t got;
+    do {
+      got = ::read(fd, &buffer[old_size], GEL_READ_CHUNK);
+    } while (got < 0 && errno == EINTR);
+    buffer.resize(old_size + (got > 0 ? got : 0));
+    input = buffer;
+
+    if (got < 0) {
+      throw reader_error("Error reading " + filename + ": " + std::strerror(errno));
+    }
+    if (got == 0) {
+      at_eof = true;
+    }
+  }
+  return true;
+}
+
+// Finds the next token and puts it in peeked
+void Reader::scan() {
+  token_start = pos;
+  while (avail() && is_space(input[pos])) {
+    if (input[pos] == '\n') {
+      line++;
+    }
+    pos++;
+    token_start = pos;
+  }
+
+  peeked_line = line;
+  has_peeked = true;
+  if (!avail()) {
+    peeked = std::string_view();
+    return;
   }
 
-  return this->input[idx].c_str();
+  char c = input[pos];
+  switch (c) {
+    case ',':
+      pos += (avail(1) && input[pos + 1] == '@') ? 2 : 1;
+      break;
+    case '(': case ')': case '[': case ']': case '{': case '}': case '\'': case '`':
+      pos++;
+      break;
+    case '"':
+      pos++;
+      while (avail() && input[pos] != '"') {
+        if (input[pos] == '\\' && avail(1)) {
+          pos++;
+        }
+        if (input[pos] == '\n') {
+          line++;
+        }
+        pos++;
+      }
+      // Take the closing quote if there is one
+      if (avail()) {
+        pos++;
+      }
+      break;
+    case ';':
+      while (avail() && input[pos] != '\n') {
+        pos++;
+      }
+      break;
+    default:
+      while (avail() && !is_space(input[pos]) && !is_delimiter(input[pos])) {
+        pos++;
+      }
+      break;
+  }
+
+  peeked = input.substr(token_start, pos - token_start);
 }
 
-// Splits input into an array of tokens (strings)
-std::vector<std::string> tokenize(const char* const input) {
-  return match_str(std::string(input));
+std::string_view Reader::next() {
+  // Returns and consumes the next token
+  if (!has_peeked) {
+    scan();
+  }
+  has_peeked = false;
+  current_line = peeked_line;
+  return peeked;
 }
 
-Reader read_str(const char* const input) {
-  return Reader(tokenize(input));
+std::string_view Reader::peek() {
+  // Returns the next token but does not consume it.
+  if (!has_peeked) {
+    scan();
+  }
+  return peeked;
+}
+
+bool Reader::done() {
+  // Comments don't count
+  while (!peek().empty() && peek()[0] == ';') {
+    next();
+  }
+  return peek().empty();
 }
 
 // String to LispInt
 // We can't use stol because we'd need to catch an exception, and we can't use atol
 // because it has undefined behavior (UB) in the spec FOR SOME REASON so we roll our
 // own
-lref stoli(std::string token) {
+lref stoli(std::string_view token) {
   int sign = 1;
 
   if (token[0] == '-') {
-    token.erase(0, 1);
+    token.remove_prefix(1);
     sign = -1;
   }
 
   LispInt sum = 0;
-  // Yes, std::string defines its own size type. This is presumably so they can
+  // Yes, std::string_view defines its own size type. This is presumably so they can
   // change it at a later time.
   // I don't know why the C++ committee thought this would be a good idea, since no
   // one is going to know about this unless they look it up on some obscure wiki page,
   // meaning everyone's code is going to break if they actually do end up changing it.
   // Except mine, since apparently I'm a raving paranoiac.
-  std::string::size_type size = token.size() - 1;
+  std::string_view::size_type size = token.size() - 1;
 
   // Compute 10^x using repeated squaring
   LispInt mult = 1;
@@ -127,14 +260,16 @@ lref read_list(Reader* const reader, const lref& end_marker) {
     }
   }
 
-  Linum& linum = line_table[(unsigned long)ret.get()];
-  linum.filename = reader->filename;
-  linum.line = original_line;
+  if (ret != Nil) {
+    auto head = static_cast<Cons*>(ret.get());
+    head->file = reader->file;
+    head->line = original_line;
+  }
   return ret;
 }
 
 lref read_atom(Reader* const reader) {
-  auto token = std::string(reader->next());
+  auto token = reader->next();
 
   if (token.size() == 0) {
     throw reader_error("Empty token. This shouldn't happen.");
@@ -142,14 +277,20 @@ lref read_atom(Reader* const reader) {
 
   // If the token started with ", we have a string
   if (token[0] == '\"') {
-    token.erase(0, 1); // Remove opening quote
-    if (token.size() < 1 || token[token.size() - 1] != '\"') {
+    if (token.size() < 2 || token[token.size() - 1] != '\"') {
       throw reader_error("Unbalanced quotation marks.");
     }
-    token.erase(token.size() - 1, 1); // Remove closing quote
-    // Unescape the string
-    token = std::regex_replace(token, backslash_quote_regex, "\"");
-    return std::make_shared<String>(token);
+    // Drop the quotes and unescape \"
+    token = token.substr(1, token.size() - 2);
+    std::string value;
+    value.reserve(token.size());
+    for (size_t i = 0; i < token.size(); i++) {
+      if (token[i] == '\\' && i + 1 < token.size() && token[i + 1] == '"') {
+        i++;
+      }
+      value += token[i];
+    }
+    return std::make_shared<String>(value);
   }
 
   if (token == "nil") {
@@ -171,13 +312,18 @@ lref read_atom(Reader* const reader) {
     return stoli(token);
   }
 
-  return std::make_shared<Symbol>(token);
+  // Only gensym makes these, so they're guaranteed unique
+  if (token.rfind("#:", 0) == 0) {
+    throw reader_error("Can't read an uninterned symbol: " + std::string(token));
+  }
+
+  return std::make_shared<Symbol>(std::string(token));
 }
 
 lref read_form(Reader* const reader) {
   auto next = reader->peek();
 
-  if (next == nullptr) {
+  if (next.empty()) {
     return nullptr;
   }
 
@@ -185,7 +331,7 @@ lref read_form(Reader* const reader) {
   while (n0 == ';') {
     reader->next();
     next = reader->peek();
-    if (next == nullptr) {
+    if (next.empty()) {
       return nullptr;
     }
     n0 = next[0];
@@ -225,25 +371,23 @@ lref read_form(Reader* const reader) {
     }
     case ',':
     {
+      // Has to be checked before reading the form, since that can refill the
+      // buffer next points into
+      bool splice = next.size() > 1 && next[1] == '@';
       reader->next();  // Consume ,
       auto form = read_form(reader);
       if (form == nullptr) {
         throw reader_error("Unquote failed. No form to unquote.");
       }
-      return cons(std::make_shared<Symbol>(next[1] == '@' ?
-                                           "splice-unquote" : "unquote"),
+      return cons(std::make_shared<Symbol>(splice ? "splice-unquote" : "unquote"),
                   cons(form, Nil));
     }
-    case '\n':
-      reader->current_line++;
-      reader->next();
-      return read_form(reader);
     default:
       return read_atom(reader);
   }
 }
 
-lref read_internal(Reader& reader, const char* const input) {
+lref read_internal(Reader& reader, std::string_view input) {
   auto res = read_form(&reader);
 
   if (res == CloseParen) {
@@ -254,7 +398,7 @@ lref read_internal(Reader& reader, const char* const input) {
     throw reader_error("Unmatched close brace in: " + std::string(input));
   }
 
-  while (reader.peek() != nullptr) {
+  while (!reader.peek().empty()) {
     auto form = read_form(&reader);
 
     if (form == CloseParen) {
@@ -269,14 +413,115 @@ lref read_internal(Reader& reader, const char* const input) {
   return res;
 }
 
-lref read(const char* const input) {
-  auto reader = Reader(match_str(input));
-  reader.filename = "[no file]";
+lref read(std::string_view input) {
+  auto reader = Reader(input, "[no file]");
   return read_internal(reader, input);
 }
 
-lref read(const char* const input, const std::string& filename) {
-  auto reader = Reader(match_str(input));
-  reader.filename = filename;
+lref read(std::string_view input, const std::string& filename) {
+  auto reader = Reader(input, filename);
   return read_internal(reader, input);
 }
+
+std::unique_ptr<Reader> open_reader(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw lisp_error("File " + path + " does not exist.");
+  }
+  return std::make_unique<Reader>(fd, path, true);
+}
+
+lref read_next(Reader& reader) {
+  auto form = read_form(&reader);
+
+  if (form == CloseParen) {
+    throw reader_error("Unmatched close parenthesis in " + reader.filename + " at line "
+                       + std::to_string(reader.current_line));
+  }
+
+  if (form == CloseBrace) {
+    throw reader_error("Unmatched close brace in " + reader.filename + " at line "
+                       + std::to_string(reader.current_line));
+  }
+
+  return form;
+}
+
+std::string read_whole_file(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw lisp_error("File " + path + " does not exist.");
+  }
+
+  std::string ret;
+  struct stat info;
+  if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+    ret.reserve(info.st_size);
+  }
+  char chunk[GEL_READ_CHUNK];
+  ssize_t got;
+  while ((got = ::read(fd, chunk, sizeof(chunk))) != 0) {
+    if (got < 0 && errno != EINTR) {
+      close(fd);
+      throw reader_error("Error reading " + path + ": " + std::strerror(errno));
+    }
+    ret.append(chunk, got > 0 ? got : 0);
+  }
+  close(fd);
+  return ret;
+}
+
+// Copied rather than mapped, so the file changing afterwards can't touch it
+lref slurp_file(const std::string& path) {
+  return std::make_shared<String>(read_whole_file(path));
+}
+
+lref read_file(const std::string& path) {
+  // Parse out of one buffer instead of a chunk at a time. The forms don't point
+  // into it, so it can go away after.
+  auto text = read_whole_file(path);
+  auto reader = std::make_unique<Reader>(text, path);
+  lref ret = Nil;
+  Cons* tail = nullptr;
+  for (auto form = read_next(*reader); form != nullptr; form = read_next(*reader)) {
+    auto cell = cons(form, Nil);
+    if (tail == nullptr) {
+      ret = cell;
+    } else {
+      tail->cdr = cell;
+    }
+    tail = static_cast<Cons*>(cell.get());
+  }
+  return ret;
+}
+
+ParallelReader::ParallelReader(std::vector<std::string> paths)
+  : paths(std::move(paths)), promises(this->paths.size()) {
+  for (auto& promise : promises) {
+    results.push_back(promise.get_future());
+  }
+
+  size_t nthreads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()),
+                                     this->paths.size());
+  for (size_t i = 0; i < nthreads; i++) {
+    workers.emplace_back([this]() {
+      for (size_t j = next++; j < this->paths.size(); j = next++) {
+        try {
+          promises[j].set_value(read_file(this->paths[j]));
+        } catch (...) {
+          promises[j].set_exception(std::current_exception());
+        }
+      }
+    });
+  }
+}
+
+ParallelReader::~ParallelReader() {
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+lref ParallelReader::get(size_t i) {
+  return results[i].get();
+}
@@ -1,7 +1,11 @@
 #ifndef READER_H
 #define READER_H
 
+#include <atomic>
+#include <future>
 #include <stdexcept>
+#include <string_view>
+#include <thread>
 #include <vector>
 
 #include "types.h"
@@ -10,36 +14,123 @@ class reader_error : public lisp_error {
     using lisp_error::lisp_error;
 };
 
+/*
+  Source locations live on the conses themselves. Filenames are stored once in
+  a table and conses just hold an index into it, so a location costs 8 bytes
+  and goes away with the cons.
+
+  intern_file("") is always 0, which means the location is unknown.
+*/
+uint32_t intern_file(const std::string& filename);
+std::string file_name(uint32_t file);
+// "file:line" for the debugger
+std::string source_location(const lref& form);
+
+/*
+  Hands out tokens one at a time, straight out of the input. Tokens are views into
+  the input, so it has to outlive the reader.
+
+  Tokens are:
+  - ( ) [ ] { } ' ` , and ,@
+  - strings, from " to the next unescaped " (or the end, which read_atom complains about)
+  - comments, from ; to the end of the line
+  - atoms, runs of anything else that isn't whitespace
+  Whitespace (newlines included) only separates tokens. Lines are counted here
+  instead, so current_line is always the line the last token came from.
+
+  A reader made from a file descriptor reads it GEL_READ_CHUNK bytes at a time as
+  tokens are asked for, and only keeps around what it hasn't handed out yet. So
+  reading a file a form at a time takes about as much memory as one form.
+*/
+const size_t GEL_READ_CHUNK = 1 << 16;
+
 class Reader {
   public:
-    Reader(const std::vector<std::string> input) {
-      this->input = input;
-      this->filename = "";
-    }
+    Reader(std::string_view input) : input(input) {}
+    Reader(std::string_view input, const std::string& filename)
+      : filename(filename), file(intern_file(filename)), input(input) {}
+    Reader(int fd, const std::string& filename, bool owns_fd)
+      : filename(filename), file(intern_file(filename)), fd(fd), owns_fd(owns_fd) {}
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+    ~Reader();
 
-    Reader(const std::vector<std::string> input, const char* const filename) {
-      this->input = input;
-      this->filename = filename;
-    }
-
-    const char* next();
-    const char* peek();
+    // Empty at the end of the input. Tokens are never empty otherwise. They point
+    // into the reader's buffer, so they're only good until the next token's read.
+    std::string_view next();
+    std::string_view peek();
+    // True if there are no more forms, only whitespace and comments
+    bool done();
 
     std::string filename;
+    uint32_t file = 0;
     int current_line = 1;
   private:
-    std::vector<std::string> input;
-    size_t idx = 0;
+    void scan();
+    bool avail(size_t n = 0);
+
+    std::string_view input;
+    // Only used when reading from a file
+    std::string buffer;
+    int fd = -1;
+    bool owns_fd = false;
+    bool at_eof = false;
+
+    size_t pos = 0;
+    size_t token_start = 0;
+    // Line pos is on
+    int line = 1;
+    bool has_peeked = false;
+    std::string_view peeked;
+    int peeked_line = 1;
+};
+
+lref read(std::string_view input);
+lref read(std::string_view input, const std::string& filename);
+
+// The whole file, read in one go. Works on pipes and such too.
+std::string read_whole_file(const std::string& path);
+// The whole file as a String. Slices of it share its chars, see slice_string.
+lref slurp_file(const std::string& path);
+
+std::unique_ptr<Reader> open_reader(const std::string& path);
+// Next top level form, or nullptr at the end
+lref read_next(Reader& reader);
+
+// Every top level form in the file, as a list
+lref read_file(const std::string& path);
+
+/*
+  Reads whole files on a pool of threads. Files get handed to the threads in
+  order, so the first ones tend to be ready first. get(i) waits for paths[i] and
+  gives back read_file's result, or rethrows whatever went wrong reading it.
+
+  Reading touches nothing shared except the file table, which is locked. Don't
+  eval anything on the pool though.
+*/
+class ParallelReader {
+  public:
+    ParallelReader(std::vector<std::string> paths);
+    ParallelReader(const ParallelReader&) = delete;
+    ParallelReader& operator=(const ParallelReader&) = delete;
+    // Waits for the threads, even if nobody wanted the rest of the files
+    ~ParallelReader();
+    lref get(size_t i);
+  private:
+    std::vector<std::string> paths;
+    std::vector<std::promise<lref>> promises;
+    std::vector<std::future<lref>> results;
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> workers;
 };
 
-lref read(const char* const input);
-lref read(const char* const input, const std::string& filename);
+// So a Reader can be handed around in lisp
+struct ReaderObject : LispObject {
+  std::unique_ptr<Reader> reader;
 
-// For the debugger
-struct Linum {
-  std::string filename;
-  int line;
+  ReaderObject(std::unique_ptr<Reader> reader) : reader(std::move(reader)) {}
+  std::string repr() const { return "<reader " + reader->filename + ">"; }
+  std::string type_string() const { return "reader"; }
 };
-extern std::unordered_map<unsigned long, Linum> line_table;
 
 #endif
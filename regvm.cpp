@@ -0,0 +1,312 @@
+#include "regvm.h"
+#include "budget.h"
+#include "builtin.h"
+#include "evaluator.h"
+
+std::string RegInstruction::repr() const {
+    auto ret = reg_opcode_names[(int)code];
+    switch (code) {
+        case RegOpcode::LOADK:
+        case RegOpcode::LOADI:
+        case RegOpcode::LOADG:
+            return ret + " " + std::to_string(a) + " "
+                + (std::dynamic_pointer_cast<RegBytecode>(k) ? "<code>" : try_repr(k));
+        case RegOpcode::MOVE:
+        case RegOpcode::LOADL:
+        case RegOpcode::STOREL:
+        case RegOpcode::JIF:
+            return ret + " " + std::to_string(a) + " " + std::to_string(b);
+        case RegOpcode::CALL:
+            return ret + " " + std::to_string(a) + " " + std::to_string(b)
+                + " " + std::to_string(c);
+        default:
+            return ret + " " + std::to_string(a);
+    }
+}
+
+std::string RegBytecode::repr() const {
+    std::string ret = "; params " + std::to_string(nparams)
+        + " locals " + std::to_string(nlocals)
+        + " regs " + std::to_string(nregs) + "\n";
+    for (const auto& instruction : code) {
+        ret += instruction.repr() + "\n";
+    }
+    return ret;
+}
+
+RegOpcode sym_to_reg_opcode(lref sym) {
+    auto as_sym = std::dynamic_pointer_cast<Symbol>(sym);
+    if (as_sym == nullptr) {
+        throw assembler_error("Opcode is not a symbol: " + try_repr(sym));
+    }
+
+    for (int i = 0; i < (int)RegOpcode::NUM_OPCODES; i++) {
+        if (as_sym->name == reg_opcode_names[i]) {
+            return (RegOpcode)i;
+        }
+    }
+
+    throw assembler_error("Bad opcode name: " + as_sym->name);
+}
+
+int int_operand(const lref& form, const lref& operand, int lo, int hi, const char* const what) {
+    auto as_int = std::dynamic_pointer_cast<LispInt>(operand);
+    if (as_int == nullptr) {
+        throw assembler_error(std::string(what) + " is not an int in " + try_repr(form));
+    }
+
+    if (as_int->val < lo || as_int->val >= hi) {
+        throw assembler_error(std::string(what) + " out of range in " + try_repr(form)
+                              + "; Expected " + std::to_string(lo) + " <= "
+                              + std::string(what) + " < " + std::to_string(hi));
+    }
+
+    return as_int->val;
+}
+
+std::shared_ptr<RegBytecode> assemble_registers(int nparams, int nlocals, int nregs, lref lst) {
+    if (nparams < 0 || nlocals < nparams || nregs < 0) {
+        throw assembler_error("Bad frame layout: params " + std::to_string(nparams)
+                              + " locals " + std::to_string(nlocals)
+                              + " regs " + std::to_string(nregs));
+    }
+
+    std::vector<RegInstruction> code;
+    // Need the length up front to check jump targets
+    int ninstructions = len(lst);
+
+    for (; lst != Nil; lst = cdr(lst)) {
+        auto form = car(lst);
+        auto op = sym_to_reg_opcode(car(form));
+        auto args = cdr(form);
+        RegInstruction instruction(op);
+
+        int expected_args;
+        switch (op) {
+            case RegOpcode::RET:
+            case RegOpcode::JMP:
+                expected_args = 1;
+                break;
+            case RegOpcode::CALL:
+                expected_args = 3;
+                break;
+            default:
+                expected_args = 2;
+                break;
+        }
+
+        if (len(args) != expected_args) {
+            throw assembler_error("Bad number of arguments in opcode: " + try_repr(form)
+                                  + "; Expected " + std::to_string(expected_args));
+        }
+
+        switch (op) {
+            case RegOpcode::LOADK:
+                instruction.a = int_operand(form, car(args), 0, nregs, "register");
+                instruction.k = cadr(args);
+                break;
+            case RegOpcode::LOADI:
+                instruction.a = int_operand(form, car(args), 0, nregs, "register");
+                instruction.k = cadr(args);
+                if (std::dynamic_pointer_cast<LispInt>(instruction.k) == nullptr) {
+                    throw assembler_error("LOADI takes an int: " + try_repr(form));
+                }
+                break;
+            case RegOpcode::LOADG:
+                instruction.a = int_operand(form, car(args), 0, nregs, "register");
+                instruction.k = cadr(args);
+                if (std::dynamic_pointer_cast<Symbol>(instruction.k) == nullptr) {
+                    throw assembler_error("LOADG takes a symbol: " + try_repr(form));
+                }
+                break;
+            case RegOpcode::MOVE:
+                instruction.a = int_operand(form, car(args), 0, nregs, "register");
+                instruction.b = int_operand(form, cadr(args), 0, nregs, "register");
+                break;
+            case RegOpcode::LOADL:
+                instruction.a = int_operand(form, car(args), 0, nregs, "register");
+                instruction.b = int_operand(form, cadr(args), 0, nlocals, "local");
+                break;
+            case RegOpcode::STOREL:
+                instruction.a = int_operand(form, car(args), 0, nlocals, "local");
+                instruction.b = int_operand(form, cadr(args), 0, nregs, "register");
+                break;
+            case RegOpcode::CALL:
+                instruction.a = int_operand(form, car(args), 0, nregs, "register");
+                instruction.b = int_operand(form, cadr(args), 0, nregs, "register");
+                // Args live in the registers right after the callee
+                instruction.c = int_operand(form, car(cddr(args)), 0,
+                                            nregs - instruction.b, "argument count");
+                break;
+            case RegOpcode::RET:
+                instruction.a = int_operand(form, car(args), 0, nregs, "register");
+                break;
+            case RegOpcode::JMP:
+                instruction.a = int_operand(form, car(args), 0, ninstructions, "jump target");
+                break;
+            case RegOpcode::JIF:
+                instruction.a = int_operand(form, car(args), 0, nregs, "register");
+                instruction.b = int_operand(form, cadr(args), 0, ninstructions, "jump target");
+                break;
+            default:
+                throw assembler_error("Unrecognized opcode: " + try_repr(form));
+        }
+
+        code.push_back(instruction);
+    }
+
+    if (code.empty() || (code.back().code != RegOpcode::RET && code.back().code != RegOpcode::JMP)) {
+        throw assembler_error("Register bytecode has to end with RET or JMP.");
+    }
+
+    return std::make_shared<RegBytecode>(nparams, nlocals, nregs, code);
+}
+
+// Saved state of a caller while the callee runs
+struct RegFrame {
+    std::shared_ptr<RegBytecode> block;
+    unsigned long pc;
+    // Start of the caller's window in the register file
+    unsigned long base;
+    // Absolute index of the register that gets the return value
+    unsigned long ret;
+};
+
+lref run_register_bytecode(const lref& block, lref args) {
+    auto current_block = std::dynamic_pointer_cast<RegBytecode>(block);
+    if (current_block == nullptr) {
+        throw vm_error("Trying to run something that isn't register bytecode.");
+    }
+
+    if (len(args) != current_block->nparams) {
+        throw vm_error("Wrong number of arguments to register bytecode: " + try_repr(args)
+                       + ", expected " + std::to_string(current_block->nparams));
+    }
+
+    // Windows are indices rather than pointers since the register file can move when
+    // it grows
+    std::vector<lref> registers(current_block->frame_size(), Nil);
+    std::vector<RegFrame> frames;
+    unsigned long base = 0;
+    unsigned long nlocals = current_block->nlocals;
+
+    for (int i = 0; args != Nil; i++, args = cdr(args)) {
+        registers[i] = car(args);
+    }
+
+    for (unsigned long pc = 0;; pc++) {
+        const auto& instruction = current_block->code[pc];
+        auto reg = [&](int idx) -> lref& { return registers[base + nlocals + idx]; };
+
+        switch (instruction.code) {
+            case RegOpcode::LOADK:
+            case RegOpcode::LOADI:
+                reg(instruction.a) = instruction.k;
+                break;
+            case RegOpcode::MOVE:
+                reg(instruction.a) = reg(instruction.b);
+                break;
+            case RegOpcode::LOADL:
+                reg(instruction.a) = registers[base + instruction.b];
+                break;
+            case RegOpcode::STOREL:
+                registers[base + instruction.a] = reg(instruction.b);
+                break;
+            case RegOpcode::LOADG:
+            {
+                auto value = env_get(current_env, instruction.k);
+                if (value == nullptr) {
+                    throw vm_error("Value " + try_repr(instruction.k) + " not in symbol table.");
+                }
+                reg(instruction.a) = value;
+            }
+                break;
+            case RegOpcode::CALL:
+            {
+                auto callee = reg(instruction.b);
+                unsigned long first_arg = base + nlocals + instruction.b + 1;
+
+                auto as_code = std::dynamic_pointer_cast<RegBytecode>(callee);
+                if (as_code != nullptr) {
+                    // No coroutines here, so running out just stops it
+                    if (!fuel_tick()) {
+                        out_of_budget();
+                    }
+                    if (instruction.c != as_code->nparams) {
+                        throw vm_error("Wrong number of arguments to register bytecode: got "
+                                       + std::to_string(instruction.c) + ", expected "
+                                       + std::to_string(as_code->nparams));
+                    }
+
+                    unsigned long new_base = base + current_block->frame_size();
+                    if (new_base + as_code->frame_size() > GEL_MAX_REGISTERS) {
+                        throw vm_error("Register file overflow.");
+                    }
+
+                    registers.resize(new_base + as_code->frame_size(), Nil);
+                    for (int i = 0; i < instruction.c; i++) {
+                        registers[new_base + i] = registers[first_arg + i];
+                    }
+
+                    frames.push_back({current_block, pc, base, base + nlocals + instruction.a});
+                    current_block = as_code;
+                    base = new_base;
+                    nlocals = as_code->nlocals;
+                    pc = -1;  // Just going to increment it
+                    break;
+                }
+
+                if (auto fn_return = std::dynamic_pointer_cast<FnReturn>(callee)) {
+                    lref arglist = Nil;
+                    for (int i = instruction.c - 1; i >= 0; i--) {
+                        arglist = cons(registers[first_arg + i], arglist);
+                    }
+                    reg(instruction.a) = apply(callee, arglist, fn_return->env, Nil);
+                    break;
+                }
+
+                // Builtins get the arg registers as a span
+                reg(instruction.a) = call_builtin(callee, &registers[first_arg], instruction.c);
+            }
+                break;
+            case RegOpcode::RET:
+            {
+                auto value = reg(instruction.a);
+                if (frames.empty()) {
+                    return value;
+                }
+
+                // Drop the callee's window
+                registers.resize(base);
+
+                auto& frame = frames.back();
+                current_block = frame.block;
+                pc = frame.pc;
+                base = frame.base;
+                nlocals = current_block->nlocals;
+                registers[frame.ret] = value;
+                frames.pop_back();
+            }
+                break;
+            case RegOpcode::JMP:
+                if ((unsigned long)instruction.a <= pc && !fuel_tick()) {
+                    out_of_budget();
+                }
+                pc = instruction.a - 1;  // -1 because we're about to increment it
+                break;
+            case RegOpcode::JIF:
+            {
+                const auto& condition = reg(instruction.a);
+                if (condition != Nil && condition != False) {
+                    if ((unsigned long)instruction.b <= pc && !fuel_tick()) {
+                        out_of_budget();
+                    }
+                    pc = instruction.b - 1;
+                }
+            }
+                break;
+            default:
+                throw vm_error("Unrecognized opcode.");
+        }
+    }
+}
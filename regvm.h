@@ -0,0 +1,78 @@
+#ifndef REGVM_H
+#define REGVM_H
+
+#include <vector>
+
+#include "vm.h"
+
+/*
+  Register-based variant of the VM.
+
+  Every function gets a window onto one big register file. The first nlocals
+  slots of the window are locals (the arguments are copied into the first
+  nparams of them), the next nregs slots are scratch registers.
+  Instructions name registers directly, so nothing has to be consed up just to
+  move it around.
+
+  This lives alongside run_bytecode so the two designs can be compared on the
+  same programs.
+*/
+enum class RegOpcode {
+LOADK,
+LOADI,
+MOVE,
+LOADL,
+STOREL,
+LOADG,
+CALL,
+RET,
+JMP,
+JIF,
+NUM_OPCODES
+};
+
+const std::string reg_opcode_names[(unsigned long)RegOpcode::NUM_OPCODES] = {
+    "LOADK",   // R[a] = k
+    "LOADI",   // R[a] = k, k has to be an int
+    "MOVE",    // R[a] = R[b]
+    "LOADL",   // R[a] = L[b]
+    "STOREL",  // L[a] = R[b]
+    "LOADG",   // R[a] = value of global symbol k
+    "CALL",    // R[a] = R[b](R[b + 1] ... R[b + c])
+    "RET",     // return R[a]
+    "JMP",     // pc = a
+    "JIF",     // if R[a] then pc = b
+};
+
+struct RegInstruction {
+    RegOpcode code;
+    int a = 0;
+    int b = 0;
+    int c = 0;
+    lref k = Nil;
+
+    RegInstruction(RegOpcode code) : code(code) {}
+    std::string repr() const;
+};
+
+// Total size of the register file shared by all frames
+const int GEL_MAX_REGISTERS = 1 << 16;
+
+struct RegBytecode : LispObject {
+    int nparams;
+    int nlocals;
+    int nregs;
+    std::vector<RegInstruction> code;
+
+    RegBytecode(int nparams, int nlocals, int nregs, std::vector<RegInstruction> code)
+        : nparams(nparams), nlocals(nlocals), nregs(nregs), code(code) {}
+    std::string repr() const;
+    std::string type_string() const { return "register-bytecode"; }
+
+    int frame_size() const { return nlocals + nregs; }
+};
+
+std::shared_ptr<RegBytecode> assemble_registers(int nparams, int nlocals, int nregs, lref lst);
+lref run_register_bytecode(const lref& block, lref args);
+
+#endif
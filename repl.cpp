@@ -1,18 +1,31 @@
-#include "reader.h"
-#include "evaluator.h"
 #include "builtin.h"
+#include "evaluator.h"
+#include "interpreter.h"
 
-void re(const char* const input) {
-  eval_toplevel(current_env, read(input));
-}
+int main(int argc, char** argv) {
+  Interpreter interpreter;
 
-int main() {
-  // Make a new env for user stuff so is-builtin? will work
-  current_env = cons(std::make_shared<Map>(), current_env);
+  // gel -c file.gel ... compiles each file to a .gelc next to it and exits. Each
+  // file gets run, so later ones can use macros from earlier ones.
+  if (argc > 1 && std::string(argv[1]) == "-c") {
+    Interpreter::Scope scope(interpreter);
+    try {
+      for (int i = 2; i < argc; i++) {
+        std::cout << compile_file(argv[i], Nil) << std::endl;
+      }
+    } catch (lisp_error& e) {
+      std::cerr << try_str(e.value) << std::endl;
+      return 1;
+    }
+    return 0;
+  }
 
-  re("(-def-internal! 'progn (fn (&rest forms) (if (empty? forms) nil (last forms))))");
-  re("(-def-internal! 'load-file (fn (path) (eval (read-string \"(progn \n\" (slurp path) \"\nnil)\"))))");
-  re("(load-file \"boot.gel\")");
+  try {
+    interpreter.load_file("boot.gel");
+  } catch (lisp_error& e) {
+    std::cerr << "Unhandled error: " << try_str(e.value) << std::endl;
+    return 1;
+  }
 
   return 0;
 }
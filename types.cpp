@@ -1,3 +1,6 @@
+#include <atomic>
+#include <vector>
+
 #include "types.h"
 #include "stacktrace.h"
 
@@ -221,7 +224,8 @@ bool map_contains(const lref& map, const lref& key) {
     throw map_error("Argument is not a map: " + try_repr(map));
   }
 
-  return as_map->value[key] != nullptr;
+  auto it = as_map->value.find(key);
+  return it != as_map->value.end() && it->second != nullptr;
 }
 
 lref cons(const lref& car, const lref& cdr) {
@@ -247,6 +251,16 @@ lref concat(const lref& list1, const lref& list2) {
   return res;
 }
 
+lref append(const lref& list1, const lref& list2) {
+  if (list1 == Nil) {
+    return list2;
+  }
+
+  auto res = copy_list(list1);
+  rplacd(tail(res), list2);
+  return res;
+}
+
 int len(lref arg) {
   int i;
   for (i = 0; arg != Nil; i++, arg = (cdr(arg)));
@@ -333,9 +347,60 @@ LispInt LispInt::operator/(const LispInt& rhs) const {
 }
 
 LispInt LispInt::operator%(const LispInt& rhs) const {
+  if (rhs.val == 0) {
+    throw arithmetic_error("Modulo by 0: "
+                           + std::to_string(val) + " % "
+                           + std::to_string(rhs.val));
+  }
+
+  // INT_MIN % -1 is UB for the same reason INT_MIN / -1 is
+  if (rhs.val == -1) {
+    return 0;
+  }
+
   return val % rhs.val;
 }
 
+lref make_int(int val) {
+  static const auto small_ints = [](){
+    std::vector<lref> ret;
+    for (int i = GEL_SMALL_INT_MIN; i < GEL_SMALL_INT_MAX; i++) {
+      ret.push_back(std::make_shared<LispInt>(i));
+    }
+    return ret;
+  }();
+
+  if (val >= GEL_SMALL_INT_MIN && val < GEL_SMALL_INT_MAX) {
+    return small_ints[val - GEL_SMALL_INT_MIN];
+  }
+
+  return std::make_shared<LispInt>(val);
+}
+
+LispFunction::LispFunction(_span_lisp_function span_value) : span_value(span_value) {
+  this->value = [span_value](lref args) -> lref {
+    // Most calls only have a few args, so keep those off the heap
+    const size_t small_size = 8;
+    lref small[small_size];
+    std::vector<lref> big;
+
+    size_t size = 0;
+    for (; args != Nil && size < small_size; args = cdr(args)) {
+      small[size++] = car(args);
+    }
+
+    if (args == Nil) {
+      return span_value(ArgSpan{small, size});
+    }
+
+    big.assign(small, small + size);
+    for (; args != Nil; args = cdr(args)) {
+      big.push_back(car(args));
+    }
+    return span_value(ArgSpan{big.data(), big.size()});
+  };
+}
+
 lisp_error::lisp_error(lref value) : value(value) {}
 
 lisp_error::lisp_error(const char* const value) {
@@ -345,3 +410,17 @@ lisp_error::lisp_error(const char* const value) {
 lisp_error::lisp_error(std::string value) {
   this->value = std::make_shared<String>(value);
 }
+
+lref slice_string(const std::shared_ptr<String>& str, size_t start, size_t end) {
+  auto chars = str->value.substr(start, end - start);
+  if (chars.size() < GEL_MIN_SHARED_SLICE) {
+    return std::make_shared<String>(std::string(chars));
+  }
+  // A slice of a slice points at the original buffer
+  return std::make_shared<String>(str->owner != nullptr ? str->owner : str, chars);
+}
+
+lref gensym() {
+  static std::atomic<uint64_t> counter{0};
+  return std::make_shared<Symbol>("#:G" + std::to_string(counter++));
+}
@@ -5,13 +5,27 @@
 #include <iostream>
 #include <memory>
 #include <sstream>
+#include <string_view>
 #include <unordered_map>
 #include <limits.h>
 
 struct LispObject;
 
 using lref = std::shared_ptr<LispObject>;
+
+// Args sitting in a row somewhere, like on the VM stack. Lets builtins be called
+// without consing up an arglist.
+struct ArgSpan {
+  const lref* data;
+  size_t size;
+
+  const lref& operator[](size_t i) const { return data[i]; }
+  const lref* begin() const { return data; }
+  const lref* end() const { return data + size; }
+};
+
 using _lisp_function = std::function<lref(lref)>;
+using _span_lisp_function = std::function<lref(ArgSpan)>;
 // Second argument is the callstack, for the debugger
 using _second_order_lisp_function = std::function<lref(lref, const lref&)>;
 
@@ -35,15 +49,22 @@ struct LispObject {
   void print() const { std::cout << this->repr(); }
   virtual bool equals(const lref& other) const { return this == other.get(); }
 
-  // TODO: There is probably a faster way to do this. Want to hash on the actual data,
-  // not the string
-  size_t hash() const {
+  // Has to match hashing the repr, since maps compare keys by repr. Things that
+  // can do that without building the repr override it.
+  virtual size_t hash() const {
     return std::hash<std::string>{}(this->repr());
   }
 };
 
 extern const lref Nil;
 
+// Ints in [GEL_SMALL_INT_MIN, GEL_SMALL_INT_MAX) are preallocated, so make_int doesn't
+// allocate for them. LispInts are never mutated once they're on the heap, so it's fine
+// to share them.
+const int GEL_SMALL_INT_MIN = -256;
+const int GEL_SMALL_INT_MAX = 1024;
+lref make_int(int val);
+
 struct LispInt : LispObject {
   int val;
 
@@ -84,11 +105,25 @@ struct Symbol : LispObject {
   Symbol(std::string name) { this->name = name; }
   std::string repr() const { return name; }
   std::string type_string() const { return "symbol"; }
+  size_t hash() const { return std::hash<std::string>{}(name); }
 };
 
+/*
+  Symbols are compared by name, so an uninterned symbol is one whose name can't
+  come from anywhere else. Gensyms are named #:G<n>, which the reader won't read,
+  and n is never reused in a process. Images give gensyms fresh names when they're
+  loaded, so ones saved by an earlier process can't collide either.
+*/
+lref gensym();
+inline bool is_gensym(const Symbol& sym) { return sym.name.rfind("#:", 0) == 0; }
+
 struct Cons : LispObject {
   lref car;
   lref cdr;
+  // Where the reader found this list, for the debugger. See intern_file in
+  // reader.h. 0 means we don't know.
+  uint32_t file = 0;
+  uint32_t line = 0;
 
   Cons(lref car, lref cdr) {
     this->car = car;
@@ -113,12 +148,27 @@ struct Cons : LispObject {
   }
 };
 
+/*
+  A string either has its own chars or is a view into a buffer something else
+  owns, like a longer string it was sliced out of. owner keeps that buffer alive.
+  Either way value is the string.
+*/
 struct String : LispObject {
-  std::string value;
-
-  String(std::string value) { this->value = value; }
-  std::string repr() const { return "\"" + value + "\""; }
-  std::string str() const { return value; }
+  // Don't touch, use value. Has to come before it so it's there when value gets
+  // pointed at it.
+  std::string own_chars;
+  std::string_view value;
+  // Null if the chars are our own
+  std::shared_ptr<const void> owner;
+
+  String(std::string value) : own_chars(std::move(value)), value(own_chars) {}
+  String(std::shared_ptr<const void> owner, std::string_view value)
+    : value(value), owner(std::move(owner)) {}
+  // value could point into own_chars
+  String(const String&) = delete;
+  String& operator=(const String&) = delete;
+  std::string repr() const { return "\"" + std::string(value) + "\""; }
+  std::string str() const { return std::string(value); }
   std::string type_string() const { return "string"; }
   bool equals(const lref& other) const {
     auto ot = std::dynamic_pointer_cast<String>(other);
@@ -126,6 +176,13 @@ struct String : LispObject {
   }
 };
 
+// Slices shorter than this get copied, since they fit in a std::string without
+// allocating and then they don't keep a whole file alive
+const size_t GEL_MIN_SHARED_SLICE = 16;
+
+// The chars from start to end, sharing str's buffer
+lref slice_string(const std::shared_ptr<String>& str, size_t start, size_t end);
+
 // We intentionally don't have a compare for this.
 // At the moment, we never create more bools than True and False,
 // so we can just point to those and compare addresses rather than having
@@ -154,6 +211,15 @@ struct LrefHash {
 // AAAAAAA
 struct LrefReprEqual {
   bool operator()(const lref& lhs, const lref& rhs) const noexcept {
+    if (lhs == rhs) {
+      return true;
+    }
+    // Most keys are symbols, and a symbol's repr is its name
+    auto lsym = dynamic_cast<const Symbol*>(lhs.get());
+    auto rsym = dynamic_cast<const Symbol*>(rhs.get());
+    if (lsym != nullptr && rsym != nullptr) {
+      return lsym->name == rsym->name;
+    }
     return lhs->repr() == rhs->repr();
   }
 };
@@ -180,9 +246,10 @@ struct Map : LispObject {
     this->value[key] = value;
   }
 
-  lref get(lref key) {
-    auto ret = this->value[key];
-    return ret != nullptr ? ret : Nil;
+  // Only ever looks, so threads in a pmap can read the same env at once
+  lref get(const lref& key) const {
+    auto it = this->value.find(key);
+    return it != this->value.end() && it->second != nullptr ? it->second : Nil;
   }
 };
 
@@ -197,8 +264,12 @@ struct ILispFunction : LispObject {
 
 struct LispFunction : ILispFunction {
   _lisp_function value;
+  // Only set for builtins that can take their args as a span. value still works
+  // for those, it just copies the list into a span first.
+  _span_lisp_function span_value;
 
   LispFunction(_lisp_function value) { this->value = value; }
+  LispFunction(_span_lisp_function span_value);
   std::string repr() const { return "<function>"; }
   std::string type_string() const { return "builtin-function"; }
   lref operator()(lref args) { return this->value(args); }
@@ -245,6 +316,8 @@ lref cddr(const lref& arg);
 lref rplaca(const lref& _cons, const lref& obj);
 lref rplacd(const lref& _cons, const lref& obj);
 lref concat(const lref& list1, const lref& list2);
+// Like concat, but list2 becomes the tail of the result instead of getting copied
+lref append(const lref& list1, const lref& list2);
 
 lref tail(const lref& arg);
 lref last(const lref& arg);
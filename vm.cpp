@@ -1,16 +1,27 @@
-#include "vm.h"
+#include <algorithm>
+#include <mutex>
 
-struct vm_error : public lisp_error { using lisp_error::lisp_error; };
+#include "vm.h"
+#include "budget.h"
+#include "builtin.h"
+#include "evaluator.h"
+#include "jit.h"
 
 bool is_bytecode(lref operand) {
     return std::dynamic_pointer_cast<Bytecode>(operand) != nullptr;
 }
 
+bool takes_argc(Opcode code) {
+    return code == Opcode::CALL || code == Opcode::TAILCALL || code == Opcode::CALL_BUILTIN
+        || code == Opcode::CALL_GLOBAL || code == Opcode::TAILCALL_GLOBAL;
+}
+
 // TODO: might be some better way to do this but I don't feel like messing with the
 // preprocessor
 std::string Instruction::repr() const {
     return opcode_names[(int)code] + " "     \
-            + (is_bytecode(operand) ? "<code>" : try_repr(operand));
+            + (is_bytecode(operand) ? "<code>" : try_repr(operand))
+            + (takes_argc(code) ? " " + std::to_string(n) : "");
 }
 
 Opcode sym_to_opcode(lref sym) {
@@ -24,20 +35,125 @@ Opcode sym_to_opcode(lref sym) {
     throw assembler_error("Bad opcode name: " + s);
 }
 
-std::vector<Instruction> assemble(lref lst) {
+bool is_pseudo(const lref& form, const char* const name) {
+    auto as_sym = std::dynamic_pointer_cast<Symbol>(car(form));
+    return as_sym != nullptr && as_sym->name == name;
+}
+
+bool is_label(const lref& form) {
+    return is_pseudo(form, "LABEL");
+}
+
+bool is_handler(const lref& form) {
+    return is_pseudo(form, "HANDLER");
+}
+
+// (LABEL name) doesn't emit anything. It just lets JIF and JMP use name instead of
+// counting instructions by hand.
+std::unordered_map<std::string, int> collect_labels(lref lst) {
+    std::unordered_map<std::string, int> labels;
+    for (int addr = 0; lst != Nil; lst = cdr(lst)) {
+        if (is_handler(car(lst))) {
+            continue;
+        }
+        if (!is_label(car(lst))) {
+            addr++;
+            continue;
+        }
+
+        if (len(car(lst)) != 2) {
+            throw assembler_error("LABEL takes a name: " + try_repr(car(lst)));
+        }
+
+        auto name = try_repr(cadr(car(lst)));
+        if (labels.count(name)) {
+            throw assembler_error("Duplicate label: " + name);
+        }
+        labels[name] = addr;
+    }
+    return labels;
+}
+
+// A jump target or handler address, either a label or a number
+lref resolve_address(const std::unordered_map<std::string, int>& labels, const lref& operand) {
+    if (std::dynamic_pointer_cast<Symbol>(operand) == nullptr) {
+        return operand;
+    }
+
+    auto label = labels.find(try_repr(operand));
+    if (label == labels.end()) {
+        throw assembler_error("Unknown label: " + try_repr(operand));
+    }
+    return std::make_shared<LispInt>(label->second);
+}
+
+// (HANDLER start end target) doesn't emit anything either, it adds to the block's
+// handler table. Range checks happen in verify.
+Handler assemble_handler(const std::unordered_map<std::string, int>& labels, const lref& form) {
+    if (len(form) != 4) {
+        throw assembler_error("HANDLER takes a start, an end and a target: " + try_repr(form));
+    }
+
+    int addrs[3];
+    lref cursor = cdr(form);
+    for (int i = 0; i < 3; i++, cursor = cdr(cursor)) {
+        auto addr = std::dynamic_pointer_cast<LispInt>(resolve_address(labels, car(cursor)));
+        if (addr == nullptr) {
+            throw assembler_error("Handler address is not an int or a label: " + try_repr(form));
+        }
+        addrs[i] = addr->val;
+    }
+    return {addrs[0], addrs[1], addrs[2]};
+}
+
+std::shared_ptr<Bytecode> assemble(lref lst) {
     std::vector<Instruction> bytecode;
+    std::vector<Handler> handlers;
+    auto labels = collect_labels(lst);
     while (lst != Nil) {
-        if (len(car(lst)) == 1) {
-            bytecode.push_back(Instruction(sym_to_opcode(car(car(lst))), Nil));
-        } else if (len(car(lst)) == 2) {
-            bytecode.push_back(Instruction(sym_to_opcode(car(car(lst))), cadr(car(lst))));
+        if (is_label(car(lst))) {
+            lst = cdr(lst);
+            continue;
+        }
+        if (is_handler(car(lst))) {
+            handlers.push_back(assemble_handler(labels, car(lst)));
+            lst = cdr(lst);
+            continue;
+        }
+
+        auto form = car(lst);
+        auto code = sym_to_opcode(car(form));
+        if (takes_argc(code)) {
+            if (len(form) != 3) {
+                throw assembler_error("Bad number of arguments in opcode: " + try_repr(form)
+                                      + "; Expected a function and an arg count");
+            }
+            auto argc = std::dynamic_pointer_cast<LispInt>(car(cddr(form)));
+            if (argc == nullptr || argc->val < 0) {
+                throw assembler_error("Bad arg count: " + try_repr(form));
+            }
+            bytecode.push_back(Instruction(code, cadr(form), argc->val));
+        } else if (code == Opcode::LOAD_ARG) {
+            auto idx = len(form) == 2 ? std::dynamic_pointer_cast<LispInt>(cadr(form)) : nullptr;
+            if (idx == nullptr || idx->val < 0) {
+                throw assembler_error("LOAD_ARG takes an index: " + try_repr(form));
+            }
+            bytecode.push_back(Instruction(code, cadr(form), idx->val));
+        } else if (len(form) == 1) {
+            bytecode.push_back(Instruction(code, Nil));
+        } else if (len(form) == 2) {
+            auto operand = cadr(form);
+            if (code == Opcode::JIF || code == Opcode::JMP) {
+                operand = resolve_address(labels, operand);
+            }
+            bytecode.push_back(Instruction(code, operand));
         } else {
-            throw assembler_error("Bad number of arguments in opcode: " + try_repr(car(lst))
+            throw assembler_error("Bad number of arguments in opcode: " + try_repr(form)
                                   + "; Expected 0 or 1");
         }
         lst = cdr(lst);
     }
-    return bytecode;
+    return std::make_shared<Bytecode>(bytecode, handlers);
 }
 
 std::string print_bytecode(const std::vector<Instruction>& bytecode) {
@@ -48,139 +164,896 @@ std::string print_bytecode(const std::vector<Instruction>& bytecode) {
     return ret;
 }
 
-struct Continuation : LispObject {
-    std::shared_ptr<Bytecode> block;
-    unsigned long pc;
+std::string Bytecode::repr() const {
+    auto ret = print_bytecode(code);
+    for (const auto& handler : handlers) {
+        ret += "; handler " + std::to_string(handler.start) + " " + std::to_string(handler.end)
+            + " -> " + std::to_string(handler.target) + "\n";
+    }
+    return ret;
+}
 
-    Continuation(const std::shared_ptr<Bytecode>& block, unsigned long pc) : block(block), pc(pc) {}
-    std::string repr() const override { return "<Continuation>"; }
-    std::string type_string() const override { return "continuation"; }
-};
+// The builtin each arithmetic/comparison opcode stands in for
+LispFunction* generic_builtin(Opcode code) {
+    switch (code) {
+        case Opcode::ADD: return plus;
+        case Opcode::SUB: return minus;
+        case Opcode::MUL: return mult;
+        case Opcode::DIV: return int_divide;
+        case Opcode::MOD: return modulo;
+        case Opcode::LT: return lt;
+        case Opcode::GT: return gt;
+        case Opcode::EQ: return equals;
+        default:
+            throw vm_error("Not an arithmetic opcode: " + opcode_names[(int)code]);
+    }
+}
 
-lref run_bytecode(const lref& block) {
-    auto bytc = std::dynamic_pointer_cast<Bytecode>(block);
-    if (bytc == nullptr) {
-        throw vm_error("Trying to run something that isn't bytecode.");
+// Two ints don't need an arglist or a trip through the builtin. The LispInt operators
+// still do the overflow checks. Anything else goes to the generic builtin, so the
+// results and errors are the same either way.
+lref binary_op(Opcode code, const lref& lhs, const lref& rhs) {
+    auto a = dynamic_cast<const LispInt*>(lhs.get());
+    auto b = dynamic_cast<const LispInt*>(rhs.get());
+    if (a == nullptr || b == nullptr) {
+        lref args[] = {lhs, rhs};
+        return generic_builtin(code)->span_value(ArgSpan{args, 2});
     }
 
-    lref stack[GEL_MAX_STACK_SIZE];
-    int stack_size = 0;
-    std::shared_ptr<Bytecode> current_block = bytc;
+    switch (code) {
+        case Opcode::ADD: return make_int((*a + *b).val);
+        case Opcode::SUB: return make_int((*a - *b).val);
+        case Opcode::MUL: return make_int((*a * *b).val);
+        case Opcode::DIV: return make_int((*a / *b).val);
+        case Opcode::MOD: return make_int((*a % *b).val);
+        case Opcode::LT: return a->val < b->val ? True : False;
+        case Opcode::GT: return a->val > b->val ? True : False;
+        case Opcode::EQ: return a->val == b->val ? True : False;
+        default:
+            throw vm_error("Not an arithmetic opcode: " + opcode_names[(int)code]);
+    }
+}
 
-    for (std::vector<Instruction>::size_type pc = 0; pc < current_block->code.size(); pc++) {
-        switch(current_block->code[pc].code) {
-            case Opcode::PUSH:
-                stack[stack_size++] = current_block->code[pc].operand;
-                break;
-            case Opcode::CONS:
+// Calls a builtin with the top argc values of the stack
+lref call_builtin(const lref& fn, const lref* args, int argc) {
+    auto lfn = dynamic_cast<LispFunction*>(fn.get());
+    if (lfn != nullptr && lfn->span_value) {
+        return lfn->span_value(ArgSpan{args, (size_t)argc});
+    }
+
+    lref arglist = Nil;
+    for (int i = argc - 1; i >= 0; i--) {
+        arglist = cons(args[i], arglist);
+    }
+
+    if (lfn != nullptr) {
+        return lfn->value(arglist);
+    }
+
+    auto sofn = dynamic_cast<SecondOrderLispFunction*>(fn.get());
+    if (sofn != nullptr) {
+        return sofn->value(arglist, Nil);
+    }
+
+    throw vm_error("Tried to call something that isn't a function: " + try_repr(fn));
+}
+
+// Held by threads in a pmap while they verify, since they can be handed the same
+// new block at once. Calls verify their callees first, so it's recursive.
+static std::recursive_mutex verify_lock;
+
+/*
+  Everything run_bytecode would otherwise have to check on every instruction gets
+  checked here, once, before the block ever runs:
+  - Operands have the right types, so the VM can cast without looking
+  - Jump targets are in range (falling off the end is allowed, it returns the top
+    of the stack)
+  - Nothing pops more than is on the stack. Depth is counted from the top of the
+    args, so a block can't eat into its own args either.
+  - Every path into an instruction arrives with the same stack depth
+  - Callees don't read more args than they get
+  - Handlers cover a real range, and nothing in it pops below the depth the handler
+    drops the stack back to
+  It also records the max stack depth, so the VM only has to check for overflow
+  once per call.
+*/
+void verify(Bytecode& block) {
+    std::unique_lock<std::recursive_mutex> lock(verify_lock, std::defer_lock);
+    if (Gel_in_parallel) {
+        lock.lock();
+    }
+    if (block.verified) {
+        return;
+    }
+
+    auto& code = block.code;
+    int size = code.size();
+
+    auto fail = [&](int pc, const std::string& msg) {
+        throw assembler_error("Bad bytecode at " + std::to_string(pc) + " ("
+                              + code[pc].repr() + "): " + msg);
+    };
+
+    // Operands
+    int nargs = 0;
+    for (int pc = 0; pc < size; pc++) {
+        auto& instruction = code[pc];
+        switch (instruction.code) {
+            case Opcode::CALL:
+            case Opcode::TAILCALL:
             {
-                if (stack_size < 2) {
-                    throw vm_error("Not enough arguments to CONS.");
+                auto callee = std::dynamic_pointer_cast<Bytecode>(instruction.operand);
+                if (callee == nullptr) {
+                    fail(pc, "Can only call bytecode.");
+                }
+                verify(*callee);
+                if (callee->nargs > instruction.n) {
+                    fail(pc, "Callee reads " + std::to_string(callee->nargs)
+                         + " args but only gets " + std::to_string(instruction.n) + ".");
                 }
-                lref car = stack[--stack_size];
-                lref cdr = stack[--stack_size];
-                stack[stack_size++] = cons(car, cdr);
             }
                 break;
+            case Opcode::CALL_GLOBAL:
+            case Opcode::TAILCALL_GLOBAL:
+                // Whatever it's bound to gets checked when it's called
+                if (dynamic_cast<Symbol*>(instruction.operand.get()) == nullptr) {
+                    fail(pc, "Can only call a global by its symbol.");
+                }
+                break;
             case Opcode::CALL_BUILTIN:
-            {
-                lref arglist = stack[--stack_size];
-                auto lfn = std::dynamic_pointer_cast<LispFunction>(current_block->code[pc].operand);
-                if (lfn == nullptr) {
-                    throw vm_error("CALL_BUILTIN takes a function.");
+                if (dynamic_cast<LispFunction*>(instruction.operand.get()) == nullptr
+                    && dynamic_cast<SecondOrderLispFunction*>(instruction.operand.get()) == nullptr) {
+                    fail(pc, "CALL_BUILTIN takes a builtin function.");
                 }
-
-                stack[stack_size++] = lfn->value(arglist);
                 break;
-            }
-            case Opcode::CALL:
-                /* Problem: how do we get the program counter to point to the code we need
-                 * to execute if said code is buried in some random object?
-                 * We can't overwrite the bytecode arg because then we don't know where to
-                 * go back to
-                 * We could recursively call run_bytecode but then we lose stack info,
-                 * making the debugger not work
-                 * We could append the bytecode to the bytecode arg, but that seems hard to
-                 * debug if it goes wrong, and creates a lot of overhead for each function
-                 * call
-                 * We could create some global store of bytecode, like an actual compiled
-                 * C++ program, but then we need to do shenanigans to keep track of addresses
-                 * and rewrite it whenever something is recompiled, which is complicated
-                 *
-                 * Solution: store a pointer to the block of code we're in in addition to the
-                 * program counter
-                 * All we really care about is that the code we need to execute exists
-                 * _somewhere_ in memory, not _where_ it is
-                 *
-                 * We can push the old code block lref along with the old program counter
-                 * so we know where to jump back to
-                 */
+            case Opcode::JIF:
+            case Opcode::JMP:
             {
-                auto new_block_lref = current_block->code[pc].operand;
-                auto new_block = std::dynamic_pointer_cast<Bytecode>(new_block_lref);
-                if (new_block == nullptr) {
-                    throw vm_error("Tried to jump to something that isn't code. This is very bad.");
+                auto addr = std::dynamic_pointer_cast<LispInt>(instruction.operand);
+                if (addr == nullptr) {
+                    fail(pc, "Jump address is not an int.");
+                }
+                if (addr->val < 0 || addr->val > size) {
+                    fail(pc, "Jump address out of range. Expected 0 <= address <= "
+                         + std::to_string(size) + ".");
                 }
-                stack[stack_size++] = std::make_shared<Continuation>(current_block, pc);
-                current_block = new_block;
-                pc = -1;  // Just going to increment it
+                instruction.n = addr->val;
             }
                 break;
-            case Opcode::RET:
-            {
-                auto return_addr = std::dynamic_pointer_cast<Continuation>(stack[--stack_size]);
-                if (return_addr == nullptr) {
-                    throw vm_error("Not a continuation.");
-                }
+            case Opcode::LOAD_ARG:
+                nargs = std::max(nargs, instruction.n + 1);
+                break;
+            default:
+                break;
+        }
+    }
 
-                auto new_block_lref = return_addr->block;
-                auto new_block = std::dynamic_pointer_cast<Bytecode>(new_block_lref);
-                if (new_block == nullptr) {
-                    throw vm_error("Tried to jump (via RET) to null. This is very bad.");
-                }
+    auto fail_handler = [&](const Handler& handler, const std::string& msg) {
+        throw assembler_error("Bad handler " + std::to_string(handler.start) + " "
+                              + std::to_string(handler.end) + " -> "
+                              + std::to_string(handler.target) + ": " + msg);
+    };
 
-                current_block = return_addr->block;
-                pc = return_addr->pc;
+    for (const auto& handler : block.handlers) {
+        if (handler.start < 0 || handler.start > handler.end || handler.end > size
+            || handler.target < 0 || handler.target > size) {
+            fail_handler(handler, "Address out of range. Expected 0 <= start <= end <= "
+                         + std::to_string(size) + " and 0 <= target <= " + std::to_string(size) + ".");
+        }
+    }
+
+    // Stack depth at the start of each instruction, -1 if we haven't gotten there yet.
+    // depth[size] is falling off the end.
+    std::vector<int> depth(size + 1, -1);
+    std::vector<int> worklist = {0};
+    depth[0] = 0;
+    int max_stack = 0;
+    // Lowest the stack gets while each instruction runs, for checking handlers
+    std::vector<int> low(size, 0);
+
+    auto flow = [&](int from, int to, int d) {
+        if (depth[to] == -1) {
+            depth[to] = d;
+            worklist.push_back(to);
+        } else if (depth[to] != d) {
+            fail(from, "Stack depth " + std::to_string(d) + " doesn't match depth "
+                 + std::to_string(depth[to]) + " from another path into " + std::to_string(to) + ".");
+        }
+    };
+
+    while (!worklist.empty()) {
+        int pc = worklist.back();
+        worklist.pop_back();
+
+        // A handler gets the depth at its start plus the thrown value
+        for (const auto& handler : block.handlers) {
+            if (handler.start == pc && handler.start < handler.end) {
+                flow(pc, handler.target, depth[pc] + 1);
+                max_stack = std::max(max_stack, depth[pc] + 1);
             }
+        }
+
+        if (pc == size) {
+            continue;
+        }
+
+        const auto& instruction = code[pc];
+        int pops = 0;
+        int pushes = 0;
+        bool falls_through = true;
+        switch (instruction.code) {
+            case Opcode::PUSH:
+            case Opcode::LOAD_ARG:
+                pushes = 1;
                 break;
-            case Opcode::POP:
-                // TODO: clean up the ref?
-                stack_size--;
+            case Opcode::YIELD:
+                // Pops the value it yields, pushes the one it's resumed with
+                pops = 1;
+                pushes = 1;
+                break;
+            case Opcode::CONS:
+            case Opcode::ADD:
+            case Opcode::SUB:
+            case Opcode::MUL:
+            case Opcode::DIV:
+            case Opcode::MOD:
+            case Opcode::LT:
+            case Opcode::GT:
+            case Opcode::EQ:
+                pops = 2;
+                pushes = 1;
+                break;
+            case Opcode::CALL_BUILTIN:
+            case Opcode::CALL:
+            case Opcode::CALL_GLOBAL:
+                pops = instruction.n;
+                pushes = 1;
+                break;
+            case Opcode::TAILCALL:
+            case Opcode::TAILCALL_GLOBAL:
+                pops = instruction.n;
+                falls_through = false;
                 break;
+            case Opcode::RET:
+            case Opcode::THROW:
+                pops = 1;
+                falls_through = false;
+                break;
+            case Opcode::POP:
             case Opcode::JIF:
-            {
-                auto addr = std::dynamic_pointer_cast<LispInt>(current_block->code[pc].operand);
-                if (addr == nullptr) {
-                    throw vm_error("Jump address is null.");
-                }
-                if (addr < 0) {
-                    throw vm_error("Jump address is < 0.");
-                }
-                auto arg1 = stack[--stack_size];
-                if (arg1 != Nil && arg1 != False) {
-                    // -1 because we're about to increment it
-                    pc = (unsigned long)(addr->val) - 1;
-                }
-            }
+                pops = 1;
                 break;
             case Opcode::JMP:
-            {
-                auto addr = std::dynamic_pointer_cast<LispInt>(current_block->code[pc].operand);
-                if (addr == nullptr) {
-                    throw vm_error("Jump address is null.");
-                }
-                if (addr < 0) {
-                    throw vm_error("Jump address is < 0.");
-                }
-                pc = (unsigned long)(addr->val) - 1;
-            }
+                falls_through = false;
                 break;
             default:
-                throw vm_error("Unrecognized opcode.");
+                fail(pc, "Unrecognized opcode.");
+        }
+
+        int d = depth[pc];
+        if (d < pops) {
+            fail(pc, "Needs " + std::to_string(pops) + " values on the stack but there are only "
+                 + std::to_string(d) + ".");
+        }
+        low[pc] = d - pops;
+        d = d - pops + pushes;
+        max_stack = std::max(max_stack, d);
+
+        if (falls_through) {
+            flow(pc, pc + 1, d);
+        }
+        if (instruction.code == Opcode::JIF || instruction.code == Opcode::JMP) {
+            flow(pc, instruction.n, d);
+        }
+    }
+
+    for (auto& handler : block.handlers) {
+        if (handler.start == handler.end) {
+            continue;
+        }
+        if (depth[handler.start] == -1) {
+            fail_handler(handler, "Start is never reached.");
+        }
+        handler.depth = depth[handler.start];
+        for (int pc = handler.start; pc < handler.end; pc++) {
+            if (depth[pc] != -1 && low[pc] < handler.depth) {
+                fail(pc, "Pops below the depth of the handler covering it.");
+            }
+        }
+    }
+
+    block.max_stack = max_stack;
+    block.nargs = nargs;
+    block.verified = true;
+}
+
+// Nothing holds on to pointers into the stack across a call, so it's fine for it to move
+static void reserve_stack(VMState& vm, int size) {
+    if ((int)vm.stack.size() < size) {
+        vm.stack.resize(std::max(size, 2 * (int)vm.stack.size()));
+    }
+}
+
+void vm_push(VMState& vm, const Instruction& instruction) {
+    vm.stack[vm.stack_size++] = instruction.operand;
+}
+
+void vm_cons(VMState& vm, const Instruction&) {
+    lref car = std::move(vm.stack[--vm.stack_size]);
+    lref cdr = std::move(vm.stack[--vm.stack_size]);
+    vm.stack[vm.stack_size++] = cons(car, cdr);
+}
+
+void vm_call_builtin(VMState& vm, const Instruction& instruction) {
+    auto result = call_builtin(instruction.operand, vm.stack.data() + vm.stack_size - instruction.n,
+                               instruction.n);
+    for (int i = 0; i < instruction.n; i++) {
+        vm.stack[--vm.stack_size] = nullptr;
+    }
+    vm.stack[vm.stack_size++] = result;
+}
+
+static void call_block(VMState& vm, std::shared_ptr<Bytecode> new_block, int argc) {
+    /* Problem: how do we get the program counter to point to the code we need
+     * to execute if said code is buried in some random object?
+     * We can't overwrite the bytecode arg because then we don't know where to
+     * go back to
+     * We could recursively call run_bytecode but then we lose stack info,
+     * making the debugger not work
+     * We could append the bytecode to the bytecode arg, but that seems hard to
+     * debug if it goes wrong, and creates a lot of overhead for each function
+     * call
+     * We could create some global store of bytecode, like an actual compiled
+     * C++ program, but then we need to do shenanigans to keep track of addresses
+     * and rewrite it whenever something is recompiled, which is complicated
+     *
+     * Solution: store a pointer to the block of code we're in in addition to the
+     * program counter
+     * All we really care about is that the code we need to execute exists
+     * _somewhere_ in memory, not _where_ it is
+     *
+     * We can push the old code block lref along with the old program counter
+     * so we know where to jump back to
+     */
+    if (vm.frames.size() >= GEL_MAX_STACK_SIZE
+        || vm.stack_size + new_block->max_stack > GEL_MAX_STACK_SIZE) {
+        throw vm_error("VM stack overflow.");
+    }
+    reserve_stack(vm, vm.stack_size + new_block->max_stack);
+    vm.frames.push_back({vm.current_block, vm.pc + 1, vm.base, vm.argc});
+    vm.argc = argc;
+    vm.base = vm.stack_size - vm.argc;
+    vm.current_block = std::move(new_block);
+    vm.pc = 0;
+}
+
+static void tailcall_block(VMState& vm, std::shared_ptr<Bytecode> new_block, int new_argc) {
+    // Same as CALL, but we're not coming back, so slide the new args down over
+    // ours and keep the return address we were given. The callee gets our
+    // frame and returns straight to our caller.
+    if (vm.base + new_argc + new_block->max_stack > GEL_MAX_STACK_SIZE) {
+        throw vm_error("VM stack overflow.");
+    }
+    for (int i = 0; i < new_argc; i++) {
+        vm.stack[vm.base + i] = std::move(vm.stack[vm.stack_size - new_argc + i]);
+    }
+    while (vm.stack_size > vm.base + new_argc) {
+        vm.stack[--vm.stack_size] = nullptr;
+    }
+    reserve_stack(vm, vm.stack_size + new_block->max_stack);
+    vm.argc = new_argc;
+    vm.current_block = std::move(new_block);
+    vm.pc = 0;
+}
+
+void vm_call(VMState& vm, const Instruction& instruction) {
+    call_block(vm, std::static_pointer_cast<Bytecode>(instruction.operand), instruction.n);
+}
+
+void vm_tailcall(VMState& vm, const Instruction& instruction) {
+    tailcall_block(vm, std::static_pointer_cast<Bytecode>(instruction.operand), instruction.n);
+}
+
+// What a CALL_GLOBAL calls, from its cache if nothing's been redefined since it last
+// looked
+// Bytecode gets checked once, when a call site first sees it
+static void check_callee(const lref& callee, const Instruction& instruction) {
+    if (auto code = dynamic_cast<Bytecode*>(callee.get())) {
+        verify(*code);
+        if (code->nargs > instruction.n) {
+            throw vm_error(try_repr(instruction.operand) + " reads " + std::to_string(code->nargs)
+                           + " args but only gets " + std::to_string(instruction.n) + ".");
+        }
+    }
+}
+
+// Held while a thread in a pmap fills in a cache other threads can see
+static std::mutex cache_lock;
+
+static const lref& global_callee(const Instruction& instruction) {
+    if (instruction.cache_epoch.load() == global_epoch) {
+        return instruction.cache;
+    }
+
+    // Every thread in a pmap has the same globals, so whichever gets here first
+    // fills it in for the rest
+    std::unique_lock<std::mutex> lock(cache_lock, std::defer_lock);
+    if (Gel_in_parallel) {
+        lock.lock();
+        if (instruction.cache_epoch.load() == global_epoch) {
+            return instruction.cache;
+        }
+    }
+
+    auto value = env_get(current_env, instruction.operand);
+    if (value == nullptr) {
+        throw vm_error("Value " + try_repr(instruction.operand) + " not in symbol table.");
+    }
+    check_callee(value, instruction);
+
+    instruction.cache = value;
+    instruction.cache_generic = dynamic_cast<GenericFunction*>(value.get()) != nullptr;
+    instruction.method_epoch = 0;
+    instruction.cache_epoch.store(global_epoch);
+    return instruction.cache;
+}
+
+// The method the GenericFunction in the cache would pick for the first of the
+// top n values, out of the call site's own cache if it's seen that type before
+static const lref& site_method(VMState& vm, const Instruction& instruction) {
+    if (instruction.n == 0) {
+        throw vm_error("Generic function " + try_repr(instruction.operand)
+                       + " needs at least one argument.");
+    }
+
+    const auto& instance = vm.stack[vm.stack_size - instruction.n];
+    const auto& type = dispatch_type(instance);
+    if (instruction.method_epoch == generic_epoch && instruction.method_type == &type) {
+        return instruction.method;
+    }
+
+    const auto& method = static_cast<GenericFunction*>(instruction.cache.get())->dispatch(instance);
+    check_callee(method, instruction);
+    if (Gel_in_parallel) {
+        // Lives in the generic's method table, which can't change during a pmap
+        return method;
+    }
+    instruction.method_type = &type;
+    instruction.method = method;
+    instruction.method_epoch = generic_epoch;
+    return instruction.method;
+}
+
+// What a CALL_GLOBAL actually ends up calling
+static const lref& resolve_global(VMState& vm, const Instruction& instruction) {
+    const auto& callee = global_callee(instruction);
+    return instruction.cache_generic ? site_method(vm, instruction) : callee;
+}
+
+// Calls something that isn't bytecode with the top argc values and replaces them
+// with the result
+static void call_other(VMState& vm, const lref& callee, int argc) {
+    const lref* args = vm.stack.data() + vm.stack_size - argc;
+    lref result;
+    if (auto fn_return = dynamic_cast<FnReturn*>(callee.get())) {
+        lref arglist = Nil;
+        for (int i = argc - 1; i >= 0; i--) {
+            arglist = cons(args[i], arglist);
+        }
+        result = apply(callee, arglist, fn_return->env, Nil);
+    } else {
+        result = call_builtin(callee, args, argc);
+    }
+
+    for (int i = 0; i < argc; i++) {
+        vm.stack[--vm.stack_size] = nullptr;
+    }
+    vm.stack[vm.stack_size++] = result;
+}
+
+bool vm_call_global(VMState& vm, const Instruction& instruction) {
+    const auto& callee = resolve_global(vm, instruction);
+    if (dynamic_cast<Bytecode*>(callee.get()) != nullptr) {
+        call_block(vm, std::static_pointer_cast<Bytecode>(callee), instruction.n);
+        return true;
+    }
+
+    call_other(vm, callee, instruction.n);
+    return false;
+}
+
+VMExit vm_tailcall_global(VMState& vm, const Instruction& instruction) {
+    const auto& callee = resolve_global(vm, instruction);
+    if (dynamic_cast<Bytecode*>(callee.get()) != nullptr) {
+        tailcall_block(vm, std::static_pointer_cast<Bytecode>(callee), instruction.n);
+        return VMExit::TRANSFER;
+    }
+
+    // Nothing to tail call into, so call it and return what it gives us
+    call_other(vm, callee, instruction.n);
+    return vm_ret(vm, instruction);
+}
+
+VMExit vm_ret(VMState& vm, const Instruction&) {
+    auto value = std::move(vm.stack[--vm.stack_size]);
+    // Returning from the code we started with
+    if (vm.frames.empty()) {
+        vm.result = value;
+        return VMExit::RETURNED;
+    }
+
+    // Drop our args and anything else we left lying around
+    while (vm.stack_size > vm.base) {
+        vm.stack[--vm.stack_size] = nullptr;
+    }
+    vm.stack[vm.stack_size++] = value;
+
+    auto& frame = vm.frames.back();
+    vm.current_block = std::move(frame.block);
+    vm.pc = frame.pc;
+    vm.base = frame.base;
+    vm.argc = frame.argc;
+    vm.frames.pop_back();
+    return VMExit::TRANSFER;
+}
+
+void vm_pop(VMState& vm, const Instruction&) {
+    vm.stack[--vm.stack_size] = nullptr;
+}
+
+bool vm_pop_truthy(VMState& vm) {
+    auto value = std::move(vm.stack[--vm.stack_size]);
+    return value != Nil && value != False;
+}
+
+void vm_load_arg(VMState& vm, const Instruction& instruction) {
+    vm.stack[vm.stack_size] = vm.stack[vm.base + instruction.n];
+    vm.stack_size++;
+}
+
+void vm_binary_op(VMState& vm, const Instruction& instruction) {
+    // Pushed left to right, so the rhs is on top
+    lref rhs = std::move(vm.stack[--vm.stack_size]);
+    lref lhs = std::move(vm.stack[--vm.stack_size]);
+    vm.stack[vm.stack_size++] = binary_op(instruction.code, lhs, rhs);
+}
+
+bool vm_pop_compare(VMState& vm, const Instruction& instruction) {
+    lref rhs = std::move(vm.stack[--vm.stack_size]);
+    lref lhs = std::move(vm.stack[--vm.stack_size]);
+    auto a = dynamic_cast<const LispInt*>(lhs.get());
+    auto b = dynamic_cast<const LispInt*>(rhs.get());
+    if (a != nullptr && b != nullptr) {
+        switch (instruction.code) {
+            case Opcode::LT: return a->val < b->val;
+            case Opcode::GT: return a->val > b->val;
+            case Opcode::EQ: return a->val == b->val;
+            default: break;
+        }
+    }
+    auto result = binary_op(instruction.code, lhs, rhs);
+    return result != Nil && result != False;
+}
+
+VMExit vm_yield(VMState& vm, const Instruction&) {
+    vm.result = std::move(vm.stack[--vm.stack_size]);
+    vm.pc++;
+    return VMExit::YIELDED;
+}
+
+// Innermost handler in block covering pc
+static const Handler* find_handler(const Bytecode& block, unsigned long pc) {
+    const Handler* found = nullptr;
+    for (const auto& handler : block.handlers) {
+        if (handler.start <= (int)pc && (int)pc < handler.end
+            && (found == nullptr || handler.end - handler.start < found->end - found->start)) {
+            found = &handler;
+        }
+    }
+    return found;
+}
+
+bool vm_unwind(VMState& vm, const lref& value) {
+    // Look first, so nothing changes if nobody handles it. Each caller is stuck in
+    // the CALL just before where it would have picked back up.
+    const Handler* found = find_handler(*vm.current_block, vm.pc);
+    int level = vm.frames.size();
+    while (found == nullptr) {
+        if (level == 0) {
+            return false;
+        }
+        level--;
+        found = find_handler(*vm.frames[level].block, vm.frames[level].pc - 1);
+    }
+
+    // Drop the frames in between
+    while ((int)vm.frames.size() > level) {
+        while (vm.stack_size > vm.base) {
+            vm.stack[--vm.stack_size] = nullptr;
+        }
+        auto& frame = vm.frames.back();
+        vm.current_block = std::move(frame.block);
+        vm.pc = frame.pc - 1;
+        vm.base = frame.base;
+        vm.argc = frame.argc;
+        vm.frames.pop_back();
+    }
+
+    while (vm.stack_size > vm.base + vm.argc + found->depth) {
+        vm.stack[--vm.stack_size] = nullptr;
+    }
+    vm.stack[vm.stack_size++] = value;
+    vm.pc = found->target;
+    return true;
+}
+
+VMExit vm_throw(VMState& vm, const Instruction&) {
+    auto value = std::move(vm.stack[--vm.stack_size]);
+    if (vm_unwind(vm, value)) {
+        return VMExit::TRANSFER;
+    }
+    throw lisp_error(value);
+}
+
+// Runs current_block from pc until control leaves it
+VMExit interpret(VMState& vm) {
+    // Everything in here has been through verify, so there's no checking operands
+    // or stack depth. Every block that gets called has been verified too.
+    const auto& code = vm.current_block->code;
+    auto pc = vm.pc;
+    // Costs nothing unless something throws, and the handler tables need to know where
+    try {
+        for (; pc < code.size(); pc++) {
+            const auto& instruction = code[pc];
+            switch(instruction.code) {
+                case Opcode::PUSH:
+                    vm_push(vm, instruction);
+                    break;
+                case Opcode::CONS:
+                    vm_cons(vm, instruction);
+                    break;
+                case Opcode::CALL_BUILTIN:
+                    vm_call_builtin(vm, instruction);
+                    break;
+                case Opcode::CALL:
+                    vm.pc = pc;
+                    vm_call(vm, instruction);
+                    return VMExit::TRANSFER;
+                case Opcode::TAILCALL:
+                    vm.pc = pc;
+                    vm_tailcall(vm, instruction);
+                    return VMExit::TRANSFER;
+                case Opcode::RET:
+                    vm.pc = pc;
+                    return vm_ret(vm, instruction);
+                case Opcode::YIELD:
+                    vm.pc = pc;
+                    return vm_yield(vm, instruction);
+                case Opcode::CALL_GLOBAL:
+                    vm.pc = pc;
+                    if (vm_call_global(vm, instruction)) {
+                        return VMExit::TRANSFER;
+                    }
+                    break;
+                case Opcode::TAILCALL_GLOBAL:
+                    vm.pc = pc;
+                    return vm_tailcall_global(vm, instruction);
+                case Opcode::THROW:
+                    vm.pc = pc;
+                    return vm_throw(vm, instruction);
+                case Opcode::POP:
+                    vm_pop(vm, instruction);
+                    break;
+                case Opcode::JIF:
+                    if (vm_pop_truthy(vm)) {
+                        if ((unsigned long)instruction.n <= pc && --*vm.fuel < 0
+                            && !fuel_tank.refill()) {
+                            vm.pc = instruction.n;
+                            return VMExit::OUT_OF_FUEL;
+                        }
+                        // -1 because we're about to increment it
+                        pc = (unsigned long)instruction.n - 1;
+                    }
+                    break;
+                case Opcode::JMP:
+                    // Only jumps backwards cost anything, they're the only way to loop
+                    if ((unsigned long)instruction.n <= pc && --*vm.fuel < 0
+                        && !fuel_tank.refill()) {
+                        vm.pc = instruction.n;
+                        return VMExit::OUT_OF_FUEL;
+                    }
+                    pc = (unsigned long)instruction.n - 1;
+                    break;
+                case Opcode::LOAD_ARG:
+                    vm_load_arg(vm, instruction);
+                    break;
+                case Opcode::ADD:
+                case Opcode::SUB:
+                case Opcode::MUL:
+                case Opcode::DIV:
+                case Opcode::MOD:
+                case Opcode::LT:
+                case Opcode::GT:
+                case Opcode::EQ:
+                    vm_binary_op(vm, instruction);
+                    break;
+                default:
+                    throw vm_error("Unrecognized opcode.");
+                    break;
+            }
+        }
+    } catch (...) {
+        vm.pc = pc;
+        throw;
+    }
+
+    return VMExit::END;
+}
+
+// Runs until the code we started with returns or something yields. Every time
+// control lands in a block it goes to native code if the block has some (or just got
+// hot enough to get some), and to the interpreter otherwise.
+VMExit run_vm(VMState& vm) {
+    vm.fuel = &fuel_tank.ticks;
+    while (true) {
+        // Every call, return and handler costs a tick. Everything's in vm at this
+        // point, so stopping here is just returning.
+        if (--*vm.fuel < 0 && !fuel_tank.refill()) {
+            return VMExit::OUT_OF_FUEL;
+        }
+
+        // Hold on to the block while it runs. A TAILCALL can drop the last other
+        // reference to it, and native code can't have its memory go away underneath it.
+        auto block = vm.current_block;
+        VMExit exit;
+        try {
+            exit = jit_ready(*block) ? jit_run(*block, vm) : interpret(vm);
+            if (exit == VMExit::ERROR) {
+                auto error = vm.error;
+                vm.error = nullptr;
+                std::rethrow_exception(error);
+            }
+        } catch (const lisp_error& e) {
+            if (vm_unwind(vm, e.value)) {
+                continue;
+            }
+            throw;
+        }
+
+        switch (exit) {
+            case VMExit::TRANSFER:
+                break;
+            case VMExit::RETURNED:
+            case VMExit::YIELDED:
+            case VMExit::OUT_OF_FUEL:
+                return exit;
+            case VMExit::END:
+                // Fell off the end without a RET
+                vm.result = vm.stack_size > 0 ? vm.stack[vm.stack_size - 1] : Nil;
+                return exit;
+            case VMExit::ERROR:
+                // Already rethrown above
                 break;
         }
     }
+}
+
+// Checks code is fit to start a run with argc args on the stack
+static std::shared_ptr<Bytecode> entry_block(const lref& code, int argc) {
+    auto bytc = std::dynamic_pointer_cast<Bytecode>(code);
+    if (bytc == nullptr) {
+        throw vm_error("Trying to run something that isn't bytecode.");
+    }
+
+    verify(*bytc);
+    if (bytc->nargs > argc) {
+        throw vm_error("Bytecode takes " + std::to_string(bytc->nargs) + " args but got "
+                       + std::to_string(argc) + ".");
+    }
+    if (argc + bytc->max_stack > GEL_MAX_STACK_SIZE) {
+        throw vm_error("VM stack overflow.");
+    }
+    return bytc;
+}
+
+lref run_bytecode(const lref& block) {
+    // The code we start with doesn't get any args
+    return call_bytecode(block, ArgSpan{nullptr, 0});
+}
+
+lref call_bytecode(const lref& code, ArgSpan args) {
+    auto bytc = entry_block(code, args.size);
+    auto vm = std::make_unique<VMState>();
+    vm->stack.resize(args.size + bytc->max_stack);
+    for (auto& arg : args) {
+        vm->stack[vm->stack_size++] = arg;
+    }
+    vm->argc = args.size;
+    vm->current_block = bytc;
+    switch (run_vm(*vm)) {
+        case VMExit::YIELDED:
+            throw vm_error("YIELD outside of a coroutine.");
+        case VMExit::OUT_OF_FUEL:
+            // Nothing to come back to, so it can only stop for good
+            out_of_budget();
+        default:
+            return vm->result;
+    }
+}
+
+std::shared_ptr<Coroutine> make_coroutine(const lref& code, ArgSpan args) {
+    auto bytc = entry_block(code, args.size);
+    auto ret = std::make_shared<Coroutine>();
+    ret->vm = std::make_unique<VMState>();
+    auto& vm = *ret->vm;
+    vm.stack.resize(args.size + bytc->max_stack);
+    for (auto& arg : args) {
+        vm.stack[vm.stack_size++] = arg;
+    }
+    vm.argc = args.size;
+    vm.current_block = bytc;
+    return ret;
+}
 
-    // TODO: horrible and hacky
-    return stack[0];
+// Runs it until it stops one way or another. When it finishes the value's left in
+// vm.result.
+static VMExit run_coroutine(Coroutine& coroutine, const lref& value) {
+    switch (coroutine.status) {
+        case Coroutine::Status::RUNNING:
+            throw vm_error("Coroutine is already running.");
+        case Coroutine::Status::DEAD:
+            throw vm_error("Coroutine has already finished.");
+        default:
+            break;
+    }
+
+    auto& vm = *coroutine.vm;
+    if (coroutine.started && !coroutine.out_of_fuel) {
+        // Value of the YIELD we stopped at. It popped one, so there's room.
+        vm.stack[vm.stack_size++] = value;
+    }
+    coroutine.started = true;
+    coroutine.out_of_fuel = false;
+
+    coroutine.status = Coroutine::Status::RUNNING;
+    VMExit exit;
+    try {
+        exit = run_vm(vm);
+    } catch (...) {
+        coroutine.status = Coroutine::Status::DEAD;
+        throw;
+    }
+
+    if (exit == VMExit::YIELDED || exit == VMExit::OUT_OF_FUEL) {
+        coroutine.status = Coroutine::Status::SUSPENDED;
+        coroutine.out_of_fuel = exit == VMExit::OUT_OF_FUEL;
+    } else {
+        coroutine.status = Coroutine::Status::DEAD;
+    }
+    return exit;
+}
+
+static lref coroutine_result(Coroutine& coroutine) {
+    auto ret = std::move(coroutine.vm->result);
+    if (coroutine.status == Coroutine::Status::DEAD) {
+        // Finished. Let go of everything it was holding on to.
+        coroutine.vm = std::make_unique<VMState>();
+    }
+    return ret;
+}
+
+lref resume(Coroutine& coroutine, const lref& value) {
+    if (run_coroutine(coroutine, value) == VMExit::OUT_OF_FUEL) {
+        // Someone further out set the budget, so it's theirs to deal with
+        out_of_budget();
+    }
+    return coroutine_result(coroutine);
+}
+
+lref resume_with_budget(Coroutine& coroutine, const lref& value, const Budget& budget) {
+    BudgetScope scope(budget);
+    if (run_coroutine(coroutine, value) == VMExit::OUT_OF_FUEL) {
+        return Nil;
+    }
+    return coroutine_result(coroutine);
 }
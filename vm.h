@@ -1,19 +1,40 @@
 #ifndef VM_H
 #define VM_H
 
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <typeinfo>
+#include <vector>
+
 #include "types.h"
 
 struct assembler_error : public lisp_error { using lisp_error::lisp_error; };
+struct vm_error : public lisp_error { using lisp_error::lisp_error; };
 
 enum class Opcode {
 PUSH,
 CONS,
 CALL_BUILTIN,
 CALL,
+TAILCALL,
 RET,
 POP,
 JIF,
 JMP,
+LOAD_ARG,
+ADD,
+SUB,
+MUL,
+DIV,
+MOD,
+LT,
+GT,
+EQ,
+YIELD,
+CALL_GLOBAL,
+TAILCALL_GLOBAL,
+THROW,
 NUM_OPCODES
 };
 
@@ -22,32 +43,230 @@ const std::string opcode_names[(unsigned long)Opcode::NUM_OPCODES] = {
     "CONS",
     "CALL_BUILTIN",
     "CALL",
+    "TAILCALL",
     "RET",
     "POP",
     "JIF",
     "JMP",
+    "LOAD_ARG",
+    "ADD",
+    "SUB",
+    "MUL",
+    "DIV",
+    "MOD",
+    "LT",
+    "GT",
+    "EQ",
+    "YIELD",
+    "CALL_GLOBAL",
+    "TAILCALL_GLOBAL",
+    "THROW",
+};
+
+/*
+  Calling convention:
+  The caller pushes the args left to right, then does (CALL code argc).
+  The callee's frame starts at the first arg (its base pointer); LOAD_ARG reads
+  relative to that. RET drops everything from the base up, pushes the return value
+  in its place and jumps back. Return addresses live on a separate control stack,
+  so the value stack only ever holds values.
+  (CALL_BUILTIN fn argc) hands the top argc values to fn as a span if it can take
+  one, or as a list if it can't.
+  (CALL_GLOBAL sym argc) calls whatever sym is bound to when it runs, so callers see
+  redefinitions. Bytecode gets called like CALL, anything else like CALL_BUILTIN.
+  Each one caches what it found until a global gets redefined, so the lookup only
+  happens once per redefinition rather than once per call.
+
+  Exceptions:
+  Nothing gets set up on the way into a try. Each block has a table of handlers
+  instead, (HANDLER start end target) in the assembler, and only gets looked at when
+  something throws. Anything thrown while pc is in [start, end) drops the stack back
+  to the depth it had at start, pushes the thrown value and jumps to target. If
+  there's no handler in the block, its frame is dropped and the caller gets a go,
+  from the CALL it's stuck in. THROW does this without involving C++ exceptions at
+  all when there's a handler to go to.
+*/
+// The epoch a cache is good for. Threads in a pmap check it while another one
+// might be filling the cache in, so it's atomic, and it only gets stored once the
+// cache is all there.
+struct CacheEpoch {
+    std::atomic<unsigned long> value{0};
+
+    CacheEpoch() = default;
+    CacheEpoch(const CacheEpoch& other) : value(other.value.load(std::memory_order_relaxed)) {}
+    CacheEpoch& operator=(const CacheEpoch& other) {
+        value.store(other.value.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        return *this;
+    }
+    unsigned long load() const { return value.load(std::memory_order_acquire); }
+    void store(unsigned long epoch) { value.store(epoch, std::memory_order_release); }
 };
 
 struct Instruction : LispObject {
     Opcode code;
     lref operand;
+    // Number of args for the CALL opcodes, index for LOAD_ARG, target for JIF and JMP
+    int n = 0;
+    // Inline cache for CALL_GLOBAL: the callee, and the global_epoch it's good for
+    mutable lref cache;
+    mutable CacheEpoch cache_epoch;
+    // When the callee is a GenericFunction, the method it picked for the last type
+    // of first arg seen here, and the generic_epoch that's good for. Never filled in
+    // from a pmap, since it changes every time a different type comes through.
+    mutable bool cache_generic = false;
+    mutable const std::type_info* method_type = nullptr;
+    mutable lref method;
+    mutable unsigned long method_epoch = 0;
 
     Instruction(Opcode code, lref operand) : code(code), operand(operand) {}
+    Instruction(Opcode code, lref operand, int n) : code(code), operand(operand), n(n) {}
     std::string repr() const;
 };
 
+// Max size of the value stack, and max depth of the control stack
 const int GEL_MAX_STACK_SIZE = 1024;
 
-std::vector<Instruction> assemble(lref lst);
+struct Bytecode;
+std::shared_ptr<Bytecode> assemble(lref lst);
 std::string print_bytecode(const std::vector<Instruction>& bytecode);
 lref run_bytecode(const lref& bytecode);
+// Runs code with args on the stack and returns what it returns
+lref call_bytecode(const lref& code, ArgSpan args);
+lref call_builtin(const lref& fn, const lref* args, int argc);
+
+struct JitCode;
+
+// Catches anything thrown from [start, end). depth is filled in by verify.
+struct Handler {
+    int start;
+    int end;
+    int target;
+    int depth = 0;
+};
 
 struct Bytecode : LispObject {
     std::vector<Instruction> code;
+    std::vector<Handler> handlers;
+    // Filled in by verify
+    bool verified = false;
+    // Most values this block ever has on the stack on top of its args
+    int max_stack = 0;
+    // Number of args it reads with LOAD_ARG
+    int nargs = 0;
+    // How many times the VM has entered this block, and its native code once it's hot.
+    // jit only gets set once, under the JIT's lock, and then published through
+    // jit_code with a release store. Anything that loads jit_code with acquire and
+    // finds it set can run it without taking the lock.
+    std::atomic<int> exec_count{0};
+    std::shared_ptr<JitCode> jit;
+    std::atomic<JitCode*> jit_code{nullptr};
+    std::atomic<bool> jit_failed{false};
 
     Bytecode(std::vector<Instruction> code) : code(code) {}
-    std::string repr () const { return print_bytecode(code); }
+    Bytecode(std::vector<Instruction> code, std::vector<Handler> handlers)
+        : code(code), handlers(handlers) {}
+    std::string repr() const;
     std::string type_string() const { return "bytecode"; }
 };
 
+void verify(Bytecode& block);
+
+// A return address on the control stack
+struct Frame {
+    std::shared_ptr<Bytecode> block;
+    // Where to pick back up
+    unsigned long pc;
+    // Where the caller's args start on the value stack
+    int base;
+    int argc;
+};
+
+// How a stretch of execution stopped
+enum class VMExit {
+    TRANSFER,  // Control went to another block, pick up at current_block and pc
+    END,       // Fell off the end of a block
+    RETURNED,  // RET out of the code we started with, the value is in result
+    YIELDED,   // YIELD, the value is in result and pc is just past it
+    ERROR,     // Native code can't unwind, so it leaves the exception in error instead
+    OUT_OF_FUEL,  // The budget ran out, pick up at current_block and pc once there's more
+};
+
+// Everything a run of the VM needs. The interpreter and the JIT both work on this,
+// so either one can pick up where the other left off.
+struct VMState {
+    // Only as big as the blocks on it need, so a suspended coroutine doesn't cost a
+    // whole GEL_MAX_STACK_SIZE
+    std::vector<lref> stack;
+    int stack_size = 0;
+    std::vector<Frame> frames;
+    std::shared_ptr<Bytecode> current_block;
+    // Next instruction to run in current_block
+    unsigned long pc = 0;
+    int base = 0;
+    int argc = 0;
+    lref result;
+    std::exception_ptr error;
+    // The running thread's fuel_tank.ticks (see budget.h), set every time run_vm
+    // starts so native code can get at it without going through a thread_local
+    long* fuel = nullptr;
+};
+
+// What each opcode does, shared by the interpreter loop and the JIT's templates.
+// The ones that leave the block expect vm.pc to be the pc of the instruction itself.
+void vm_push(VMState& vm, const Instruction& instruction);
+void vm_cons(VMState& vm, const Instruction& instruction);
+void vm_call_builtin(VMState& vm, const Instruction& instruction);
+void vm_call(VMState& vm, const Instruction& instruction);
+void vm_tailcall(VMState& vm, const Instruction& instruction);
+// Whether control left the block
+bool vm_call_global(VMState& vm, const Instruction& instruction);
+VMExit vm_tailcall_global(VMState& vm, const Instruction& instruction);
+VMExit vm_ret(VMState& vm, const Instruction& instruction);
+void vm_pop(VMState& vm, const Instruction& instruction);
+bool vm_pop_truthy(VMState& vm);
+void vm_load_arg(VMState& vm, const Instruction& instruction);
+void vm_binary_op(VMState& vm, const Instruction& instruction);
+// vm_binary_op then vm_pop_truthy, for an LT, GT or EQ going straight into a JIF.
+// Skips making the boolean just to pop it back off.
+bool vm_pop_compare(VMState& vm, const Instruction& instruction);
+VMExit vm_yield(VMState& vm, const Instruction& instruction);
+VMExit vm_throw(VMState& vm, const Instruction& instruction);
+// Finds the handler for something thrown at vm.pc and sets everything up to run it.
+// False if nothing in any frame handles it.
+bool vm_unwind(VMState& vm, const lref& value);
+
+VMExit run_vm(VMState& vm);
+
+/*
+  A run of the VM that can stop partway through with YIELD and be picked up again
+  later with resume. It has its own value and control stacks, so YIELD can happen
+  any number of calls deep.
+  resume's value becomes the value of the YIELD it resumes. The first resume just
+  starts it, there's no YIELD to give the value to.
+*/
+struct Coroutine : LispObject {
+    enum class Status { SUSPENDED, RUNNING, DEAD };
+
+    std::unique_ptr<VMState> vm;
+    Status status = Status::SUSPENDED;
+    bool started = false;
+    // Stopped because its budget ran out rather than at a YIELD, so there's nothing
+    // for the next resume's value to go to
+    bool out_of_fuel = false;
+
+    std::string repr() const { return "<coroutine>"; }
+    std::string type_string() const { return "coroutine"; }
+};
+
+std::shared_ptr<Coroutine> make_coroutine(const lref& code, ArgSpan args);
+// Returns the value it yields, or its return value once it finishes. If whatever
+// budget it's under runs out, it throws a budget_error but the coroutine stays
+// suspended, so it can be resumed again.
+lref resume(Coroutine& coroutine, const lref& value);
+
+struct Budget;
+// Same, but stops quietly when budget runs out, with out_of_fuel set and nil as
+// the value. Resuming it again carries on from there.
+lref resume_with_budget(Coroutine& coroutine, const lref& value, const Budget& budget);
+
 #endif